@@ -32,6 +32,7 @@
  */
 #include "uvc_control.h"
 #include "uvc_video.h"
+#include "uvc_frame.h"
 #include <camera_engine_rkisp/interface/rkisp_api.h>
 
 #include <stdio.h>
@@ -53,6 +54,8 @@ struct camera_param {
 static struct camera_param g_param;
 static pthread_t g_th;
 static bool g_run;
+/* the one camera streaming, frames go back to it from the encode worker */
+static const struct rkisp_api_ctx *g_ctx;
 
 int get_video_id(char *name)
 {
@@ -81,6 +84,63 @@ int get_video_id(char *name)
     return (i == MAX_VIDEO_ID ? -1 : i);
 }
 
+/* a capture buffer on its way through uvc_control, freed on release */
+struct camera_frame {
+    struct uvc_frame frame;
+    int cnt;
+};
+
+static pthread_mutex_t g_frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_frame_cond = PTHREAD_COND_INITIALIZER;
+static int g_frame_count;
+
+static void camera_release(struct uvc_frame *frame)
+{
+    rkisp_put_frame(g_ctx, (const struct rkisp_api_buf *)frame->priv);
+    free(frame);
+    pthread_mutex_lock(&g_frame_lock);
+    g_frame_count--;
+    pthread_cond_broadcast(&g_frame_cond);
+    pthread_mutex_unlock(&g_frame_lock);
+}
+
+static void camera_submit(const struct rkisp_api_ctx *ctx,
+                          const struct rkisp_api_buf *buf,
+                          int width, int height, int *extra_cnt)
+{
+    struct camera_frame *f = calloc(1, sizeof(*f));
+
+    if (!f) {
+        rkisp_put_frame(ctx, buf);
+        return;
+    }
+    pthread_mutex_lock(&g_frame_lock);
+    g_frame_count++;
+    pthread_mutex_unlock(&g_frame_lock);
+    uvc_frame_init(&f->frame, V4L2_PIX_FMT_NV12, width, height, buf->buf,
+                   buf->fd, buf->size, camera_release, (void *)buf);
+    f->frame.timestamp = buf->timestamp.tv_sec * 1000000ULL + buf->timestamp.tv_usec;
+    f->frame.sequence = buf->sequence;
+    f->cnt = ++(*extra_cnt);
+    f->frame.meta[0].type = UVC_META_RAW;
+    f->frame.meta[0].data = &f->cnt;
+    f->frame.meta[0].size = sizeof(f->cnt);
+    f->frame.meta_count = 1;
+    uvc_submit_frame(&f->frame);
+    /* the worker holds its own reference, or this releases the frame */
+    uvc_frame_put(&f->frame);
+}
+
+/* wait for uvc_control to hand back every buffer of this ctx */
+static void camera_flush(void)
+{
+    uvc_submit_flush();
+    pthread_mutex_lock(&g_frame_lock);
+    while (g_frame_count)
+        pthread_cond_wait(&g_frame_cond, &g_frame_lock);
+    pthread_mutex_unlock(&g_frame_lock);
+}
+
 int isp_uvc(int width, int height)
 {
     const struct rkisp_api_ctx *ctx;
@@ -111,6 +171,7 @@ int isp_uvc(int width, int height)
 
     if (rkisp_start_capture(ctx))
         return -1;
+    g_ctx = ctx;
 
     do {
         buf = rkisp_get_frame(ctx, 0);
@@ -118,12 +179,10 @@ int isp_uvc(int width, int height)
             printf("%s: rkisp_get_frame NULL\n", __func__);
             break;
         }
-        extra_cnt++;
-        uvc_read_camera_buffer(buf->buf, buf->fd, buf->size,
-                               &extra_cnt, sizeof(extra_cnt));
-        rkisp_put_frame(ctx, buf);
+        camera_submit(ctx, buf, width, height, &extra_cnt);
     } while (g_run);
 
+    camera_flush();
     rkisp_stop_capture(ctx);
     rkisp_close_device(ctx);
 
@@ -183,6 +242,7 @@ int cif_uvc(int width, int height)
 
     if (rkisp_start_capture(ctx))
         return -1;
+    g_ctx = ctx;
 
     do {
         buf = rkisp_get_frame(ctx, 0);
@@ -190,12 +250,10 @@ int cif_uvc(int width, int height)
             printf("%s: rkisp_get_frame NULL\n", __func__);
             break;
         }
-        extra_cnt++;
-        uvc_read_camera_buffer(buf->buf, buf->fd, buf->size,
-                               &extra_cnt, sizeof(extra_cnt));
-        rkisp_put_frame(ctx, buf);
+        camera_submit(ctx, buf, width, height, &extra_cnt);
     } while (g_run);
 
+    camera_flush();
     rkisp_stop_capture(ctx);
     rkisp_close_device(ctx);
 
@@ -224,14 +282,54 @@ void close_cif_uvc(void)
     pthread_join(g_th, NULL);
 }
 
+#define PREWARM_MAX 4
+
+struct prewarm_cfg {
+    int fcc;
+    int width;
+    int height;
+};
+
+static int parse_prewarm(const char *arg, struct prewarm_cfg *cfg)
+{
+    char codec[8];
+
+    if (sscanf(arg, "%7[^:]:%dx%d", codec, &cfg->width, &cfg->height) != 3)
+        return -1;
+    if (!strcmp(codec, "mjpeg"))
+        cfg->fcc = V4L2_PIX_FMT_MJPEG;
+    else if (!strcmp(codec, "h264"))
+        cfg->fcc = V4L2_PIX_FMT_H264;
+    else if (!strcmp(codec, "h265"))
+        cfg->fcc = V4L2_PIX_FMT_HEVC;
+    else
+        return -1;
+    return 0;
+}
+
 void usage(const char *name)
 {
     printf("Usage: %s options\n"
            "-i --isp   Use isp camera.\n"
            "-c --cif   Use cif camera.\n"
+           "-f --fixed <width>x<height>  Keep the camera at this resolution,\n"
+           "           scale it for every uvc format.\n"
+           "-a --async Pipelined MJPEG/H.264 encode.\n"
+           "-s --slice <bytes> H.264/H.265 slices of about this size,\n"
+           "           each copied out as soon as it is encoded.\n"
+           "-l --low-latency H.264/H.265 intra refresh, no periodic IDR.\n"
+           "-b --baseline  As -l, H.264 in constrained baseline profile.\n"
+           "-e --encoder <mpp|cpu|auto> MJPEG on the VPU (default), the CPU,\n"
+           "           or the CPU only when the VPU fails.\n"
+           "-m --max-frame <bytes> Encode MJPEG coarser, drop H.264/H.265,\n"
+           "           rather than send larger frames.\n"
+           "-w --prewarm <mjpeg|h264|h265>:<width>x<height>\n"
+           "           Create this encoder at startup, may be repeated.\n"
            , name);
     printf("e.g. %s -i\n", name);
     printf("e.g. %s -c\n", name);
+    printf("e.g. %s -i -f 1920x1080\n", name);
+    printf("e.g. %s -i -w mjpeg:1280x720 -w h264:1920x1080\n", name);
     exit(0);
 }
 
@@ -241,12 +339,29 @@ int main(int argc, char* argv[])
 
     bool g_isp_en = false;
     bool g_cif_en = false;
+    int fixed_width = 0, fixed_height = 0;
 
     int next_option;
-    const char* const short_options = "ic";
+    bool async = false;
+    int slice_bytes = 0;
+    long max_frame = 0;
+    bool low_latency = false, baseline = false;
+    struct prewarm_cfg prewarm[PREWARM_MAX];
+    int prewarm_count = 0;
+    int i;
+    const char* const short_options = "icf:as:lbe:m:w:";
     const struct option long_options[] = {
         {"isp", 0, NULL, 'i'},
         {"cif", 0, NULL, 'c'},
+        {"fixed", 1, NULL, 'f'},
+        {"async", 0, NULL, 'a'},
+        {"slice", 1, NULL, 's'},
+        {"low-latency", 0, NULL, 'l'},
+        {"baseline", 0, NULL, 'b'},
+        {"encoder", 1, NULL, 'e'},
+        {"max-frame", 1, NULL, 'm'},
+        {"prewarm", 1, NULL, 'w'},
+        {NULL, 0, NULL, 0},
     };
 
     do {
@@ -258,6 +373,40 @@ int main(int argc, char* argv[])
         case 'c':
             g_cif_en = true;
             break;
+        case 'f':
+            if (sscanf(optarg, "%dx%d", &fixed_width, &fixed_height) != 2)
+                usage(argv[0]);
+            break;
+        case 'a':
+            async = true;
+            break;
+        case 's':
+            slice_bytes = atoi(optarg);
+            if (slice_bytes <= 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            low_latency = true;
+            break;
+        case 'b':
+            low_latency = true;
+            baseline = true;
+            break;
+        case 'e':
+            if (uvc_control_encode_backend(optarg))
+                usage(argv[0]);
+            break;
+        case 'm':
+            max_frame = atol(optarg);
+            if (max_frame <= 0)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if (prewarm_count >= PREWARM_MAX ||
+                parse_prewarm(optarg, &prewarm[prewarm_count]))
+                usage(argv[0]);
+            prewarm_count++;
+            break;
         case -1:
             break;
         default:
@@ -277,6 +426,14 @@ int main(int argc, char* argv[])
         register_uvc_close_camera(close_cif_uvc);
     }
 
+    uvc_control_fixed_capture(fixed_width, fixed_height);
+    uvc_control_async_encode(async);
+    uvc_control_slice_encode(slice_bytes);
+    uvc_control_low_latency(low_latency, baseline);
+    uvc_control_frame_size_cap(max_frame);
+    for (i = 0; i < prewarm_count; i++)
+        uvc_control_prewarm(prewarm[i].width, prewarm[i].height, prewarm[i].fcc);
+
     flags = UVC_CONTROL_LOOP_ONCE;
     uvc_control_run(flags);
 
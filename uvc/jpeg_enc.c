@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <jpeglib.h>
+#include <linux/videodev2.h>
+#include "jpeg_enc.h"
+
+#define JPEG_ENC_QUALITY 75
+
+struct jpeg_enc_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+/*
+ * A band of whole MCU rows, compressed on its own as a small JPEG. Its
+ * entropy coded data is exactly what follows a restart marker in the
+ * whole frame, see jpeg_enc_stitch.
+ */
+struct jpeg_enc_band {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_enc_error err;
+    /* first luma row and number of rows */
+    int row;
+    int rows;
+    /* chroma of one MCU row, deinterleaved from NV12/NV21/NV16 */
+    JSAMPLE *cb;
+    JSAMPLE *cr;
+    unsigned char *out;
+    unsigned long out_size;
+    unsigned long len;
+    int ret;
+};
+
+struct jpeg_enc {
+    int width;
+    int height;
+    unsigned int fcc;
+    /* 2 for 4:2:0, 1 for 4:2:2 */
+    int chroma_v;
+    struct jpeg_enc_band *bands;
+    int band_count;
+    /* MCUs per band, the restart interval */
+    unsigned int interval;
+    /* the bands joined with RSTn markers */
+    unsigned char *frame;
+    size_t frame_size;
+    /* band_count - 1 workers, the caller encodes bands too */
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    const JSAMPLE *src;
+    unsigned int seq;
+    int next_band;
+    int bands_done;
+    bool stop;
+};
+
+/* libjpeg exits the process on errors unless we jump out */
+static void jpeg_enc_error_exit(j_common_ptr cinfo)
+{
+    struct jpeg_enc_error *err = (struct jpeg_enc_error *)cinfo->err;
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    printf("jpeg_enc: %s\n", msg);
+    longjmp(err->jmp, 1);
+}
+
+static int jpeg_enc_band_init(struct jpeg_enc *j, struct jpeg_enc_band *b)
+{
+    b->cb = (JSAMPLE *)malloc(j->width / 2 * DCTSIZE);
+    b->cr = (JSAMPLE *)malloc(j->width / 2 * DCTSIZE);
+    /* libjpeg grows it when a band does not fit */
+    b->out_size = j->width * b->rows;
+    b->out = (unsigned char *)malloc(b->out_size);
+    if (!b->cb || !b->cr || !b->out)
+        return -1;
+
+    b->cinfo.err = jpeg_std_error(&b->err.mgr);
+    b->err.mgr.error_exit = jpeg_enc_error_exit;
+    if (setjmp(b->err.jmp))
+        return -1;
+    jpeg_create_compress(&b->cinfo);
+    b->cinfo.image_width = j->width;
+    b->cinfo.image_height = b->rows;
+    b->cinfo.input_components = 3;
+    b->cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&b->cinfo);
+    jpeg_set_colorspace(&b->cinfo, JCS_YCbCr);
+    /* planes go in as they are, no color conversion or downsampling */
+    b->cinfo.raw_data_in = TRUE;
+    b->cinfo.dct_method = JDCT_IFAST;
+    b->cinfo.comp_info[0].h_samp_factor = 2;
+    b->cinfo.comp_info[0].v_samp_factor = j->chroma_v;
+    b->cinfo.comp_info[1].h_samp_factor = 1;
+    b->cinfo.comp_info[1].v_samp_factor = 1;
+    b->cinfo.comp_info[2].h_samp_factor = 1;
+    b->cinfo.comp_info[2].v_samp_factor = 1;
+    jpeg_set_quality(&b->cinfo, JPEG_ENC_QUALITY, TRUE);
+
+    return 0;
+}
+
+/*
+ * Point the rows at the MCU row starting at luma row row of each plane,
+ * repeating the last row past the bottom edge.
+ */
+static void jpeg_enc_rows(struct jpeg_enc *j, struct jpeg_enc_band *b,
+                          const JSAMPLE *src, int row, JSAMPROW *y_rows,
+                          JSAMPROW *cb_rows, JSAMPROW *cr_rows)
+{
+    int w = j->width, h = j->height;
+    int ch = (h + j->chroma_v - 1) / j->chroma_v;
+    const JSAMPLE *uv = src + w * h;
+    const JSAMPLE *line;
+    int i, x, r;
+
+    for (i = 0; i < DCTSIZE * j->chroma_v; i++) {
+        r = row + i;
+        y_rows[i] = (JSAMPROW)src + (r < h ? r : h - 1) * w;
+    }
+    for (i = 0; i < DCTSIZE; i++) {
+        r = row / j->chroma_v + i;
+        if (r >= ch)
+            r = ch - 1;
+        if (j->fcc == V4L2_PIX_FMT_YUV420) {
+            cb_rows[i] = (JSAMPROW)uv + r * (w / 2);
+            cr_rows[i] = (JSAMPROW)uv + ch * (w / 2) + r * (w / 2);
+            continue;
+        }
+        line = uv + r * w;
+        cb_rows[i] = b->cb + i * (w / 2);
+        cr_rows[i] = b->cr + i * (w / 2);
+        if (j->fcc == V4L2_PIX_FMT_NV21) {
+            for (x = 0; x < w / 2; x++) {
+                cr_rows[i][x] = line[2 * x];
+                cb_rows[i][x] = line[2 * x + 1];
+            }
+        } else {
+            for (x = 0; x < w / 2; x++) {
+                cb_rows[i][x] = line[2 * x];
+                cr_rows[i][x] = line[2 * x + 1];
+            }
+        }
+    }
+}
+
+static int jpeg_enc_band_encode(struct jpeg_enc *j, struct jpeg_enc_band *b)
+{
+    JSAMPROW y_rows[DCTSIZE * 2], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    int lines = DCTSIZE * j->chroma_v;
+    unsigned char *buf = b->out;
+    unsigned long size = b->out_size;
+    int row;
+
+    if (setjmp(b->err.jmp)) {
+        jpeg_abort_compress(&b->cinfo);
+        return -1;
+    }
+    jpeg_mem_dest(&b->cinfo, &buf, &size);
+    jpeg_start_compress(&b->cinfo, TRUE);
+    for (row = b->row; row < b->row + b->rows; row += lines) {
+        jpeg_enc_rows(j, b, j->src, row, y_rows, cb_rows, cr_rows);
+        jpeg_write_raw_data(&b->cinfo, planes, lines);
+    }
+    jpeg_finish_compress(&b->cinfo);
+
+    if (buf != b->out) {
+        free(b->out);
+        b->out = buf;
+        b->out_size = size;
+    }
+    b->len = size;
+
+    return 0;
+}
+
+/* Called with lock held, encodes bands until none is left. */
+static void jpeg_enc_run_bands(struct jpeg_enc *j)
+{
+    struct jpeg_enc_band *b;
+
+    while (j->next_band < j->band_count) {
+        b = &j->bands[j->next_band++];
+        pthread_mutex_unlock(&j->lock);
+        b->ret = jpeg_enc_band_encode(j, b);
+        pthread_mutex_lock(&j->lock);
+        if (++j->bands_done == j->band_count)
+            pthread_cond_broadcast(&j->done_cond);
+    }
+}
+
+static void *jpeg_enc_worker(void *arg)
+{
+    struct jpeg_enc *j = (struct jpeg_enc *)arg;
+    unsigned int seq = 0;
+
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        while (!j->stop && j->seq == seq)
+            pthread_cond_wait(&j->cond, &j->lock);
+        if (j->stop)
+            break;
+        seq = j->seq;
+        jpeg_enc_run_bands(j);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    return NULL;
+}
+
+/* Offsets of SOF0, SOS and the entropy coded data after it. */
+static int jpeg_enc_parse(const unsigned char *buf, unsigned long len,
+                          unsigned long *sof, unsigned long *sos,
+                          unsigned long *data)
+{
+    unsigned long pos = 2;
+    unsigned int seg;
+
+    *sof = 0;
+    while (pos + 4 <= len && buf[pos] == 0xff) {
+        seg = (buf[pos + 2] << 8) | buf[pos + 3];
+        if (buf[pos + 1] == 0xc0)
+            *sof = pos;
+        if (buf[pos + 1] == 0xda) {
+            *sos = pos;
+            *data = pos + 2 + seg;
+            return *sof && *data + 2 <= len ? 0 : -1;
+        }
+        pos += 2 + seg;
+    }
+
+    return -1;
+}
+
+/*
+ * One JPEG from the bands: the headers of band 0 with the frame height
+ * in SOF0 and a DRI of one band, then the entropy coded data of every
+ * band, separated by RST0-RST7 in turn.
+ */
+static int jpeg_enc_stitch(struct jpeg_enc *j, void **data, size_t *len)
+{
+    struct jpeg_enc_band *b = &j->bands[0];
+    unsigned long sof, sos, start;
+    size_t size = b->len + 6;
+    unsigned char *p;
+    int i;
+
+    for (i = 1; i < j->band_count; i++)
+        size += j->bands[i].len + 2;
+    if (size > j->frame_size) {
+        p = (unsigned char *)realloc(j->frame, size);
+        if (!p)
+            return -1;
+        j->frame = p;
+        j->frame_size = size;
+    }
+
+    if (jpeg_enc_parse(b->out, b->len, &sof, &sos, &start))
+        return -1;
+    p = j->frame;
+    memcpy(p, b->out, sos);
+    p[sof + 5] = j->height >> 8;
+    p[sof + 6] = j->height & 0xff;
+    p += sos;
+    *p++ = 0xff;
+    *p++ = 0xdd;
+    *p++ = 0x00;
+    *p++ = 0x04;
+    *p++ = j->interval >> 8;
+    *p++ = j->interval & 0xff;
+    memcpy(p, b->out + sos, start - sos);
+    p += start - sos;
+
+    for (i = 0; i < j->band_count; i++) {
+        b = &j->bands[i];
+        if (i && jpeg_enc_parse(b->out, b->len, &sof, &sos, &start))
+            return -1;
+        /* without the EOI */
+        memcpy(p, b->out + start, b->len - 2 - start);
+        p += b->len - 2 - start;
+        if (i + 1 < j->band_count) {
+            *p++ = 0xff;
+            *p++ = 0xd0 + i % 8;
+        }
+    }
+    *p++ = 0xff;
+    *p++ = 0xd9;
+
+    *data = j->frame;
+    *len = p - j->frame;
+
+    return 0;
+}
+
+struct jpeg_enc *jpeg_enc_create(int width, int height, unsigned int fcc,
+                                 int threads)
+{
+    struct jpeg_enc *j;
+    int chroma_v, mcu_rows, band_rows, i;
+
+    switch (fcc) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+        chroma_v = 2;
+        break;
+    case V4L2_PIX_FMT_NV16:
+        chroma_v = 1;
+        break;
+    default:
+        printf("%s: not support fcc: %u\n", __func__, fcc);
+        return NULL;
+    }
+    if (width <= 0 || height <= 0 || width % 16) {
+        printf("%s: not support size %dx%d\n", __func__, width, height);
+        return NULL;
+    }
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > JPEG_ENC_THREADS_MAX)
+        threads = JPEG_ENC_THREADS_MAX;
+    if (threads < 1)
+        threads = 1;
+
+    j = (struct jpeg_enc *)calloc(1, sizeof(*j));
+    if (!j)
+        return NULL;
+    j->width = width;
+    j->height = height;
+    j->fcc = fcc;
+    j->chroma_v = chroma_v;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->done_cond, NULL);
+
+    /* one band per thread, of whole MCU rows, the last may be shorter */
+    mcu_rows = (height + DCTSIZE * chroma_v - 1) / (DCTSIZE * chroma_v);
+    band_rows = (mcu_rows + threads - 1) / threads;
+    /* DRI holds 16 bits */
+    while ((unsigned long)band_rows * (width / 16) > 0xffff)
+        band_rows--;
+    j->interval = band_rows * (width / 16);
+    j->band_count = (mcu_rows + band_rows - 1) / band_rows;
+    j->bands = (struct jpeg_enc_band *)calloc(j->band_count, sizeof(*j->bands));
+    if (!j->bands) {
+        jpeg_enc_destroy(j);
+        return NULL;
+    }
+    for (i = 0; i < j->band_count; i++) {
+        j->bands[i].row = i * band_rows * DCTSIZE * chroma_v;
+        j->bands[i].rows = band_rows * DCTSIZE * chroma_v;
+        if (j->bands[i].rows > height - j->bands[i].row)
+            j->bands[i].rows = height - j->bands[i].row;
+        if (jpeg_enc_band_init(j, &j->bands[i])) {
+            jpeg_enc_destroy(j);
+            return NULL;
+        }
+    }
+
+    j->threads = (pthread_t *)calloc(j->band_count, sizeof(pthread_t));
+    if (!j->threads) {
+        jpeg_enc_destroy(j);
+        return NULL;
+    }
+    for (i = 0; i < j->band_count - 1; i++) {
+        if (pthread_create(&j->threads[i], NULL, jpeg_enc_worker, j))
+            break;
+        j->thread_count++;
+    }
+    printf("%s: %dx%d in %d bands of %d rows, %d threads\n", __func__,
+           width, height, j->band_count, j->bands[0].rows, j->thread_count + 1);
+
+    return j;
+}
+
+void jpeg_enc_destroy(struct jpeg_enc *j)
+{
+    int i;
+
+    if (!j)
+        return;
+    pthread_mutex_lock(&j->lock);
+    j->stop = true;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    for (i = 0; i < j->thread_count; i++)
+        pthread_join(j->threads[i], NULL);
+    free(j->threads);
+
+    for (i = 0; j->bands && i < j->band_count; i++) {
+        jpeg_destroy_compress(&j->bands[i].cinfo);
+        free(j->bands[i].cb);
+        free(j->bands[i].cr);
+        free(j->bands[i].out);
+    }
+    free(j->bands);
+    free(j->frame);
+    pthread_cond_destroy(&j->done_cond);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+static void jpeg_enc_band_quality(struct jpeg_enc_band *b, int quality)
+{
+    if (setjmp(b->err.jmp))
+        return;
+    jpeg_set_quality(&b->cinfo, quality, TRUE);
+}
+
+void jpeg_enc_set_quality(struct jpeg_enc *j, int quality)
+{
+    int i;
+
+    if (quality < 1)
+        quality = 1;
+    if (quality > 100)
+        quality = 100;
+    /* every band must use the same tables */
+    for (i = 0; i < j->band_count; i++)
+        jpeg_enc_band_quality(&j->bands[i], quality);
+}
+
+int jpeg_enc_encode(struct jpeg_enc *j, const void *src, void **data, size_t *len)
+{
+    int i;
+
+    pthread_mutex_lock(&j->lock);
+    j->src = (const JSAMPLE *)src;
+    j->next_band = 0;
+    j->bands_done = 0;
+    j->seq++;
+    pthread_cond_broadcast(&j->cond);
+    jpeg_enc_run_bands(j);
+    while (j->bands_done < j->band_count)
+        pthread_cond_wait(&j->done_cond, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+
+    for (i = 0; i < j->band_count; i++)
+        if (j->bands[i].ret)
+            return -1;
+    if (j->band_count == 1) {
+        *data = j->bands[0].out;
+        *len = j->bands[0].len;
+        return 0;
+    }
+
+    return jpeg_enc_stitch(j, data, len);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __JPEG_ENC_H__
+#define __JPEG_ENC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Baseline JPEG on the CPU with libjpeg, for hosts without a VPU or when
+ * the VPU cannot take another session. Input is NV12, NV21, NV16 or I420
+ * (V4L2 fourcc) of a width that is a multiple of 16.
+ *
+ * The frame is cut into one band of MCU rows per thread. The bands are
+ * compressed in parallel and joined with restart markers (DRI/RSTn) into
+ * one baseline JPEG.
+ */
+#define JPEG_ENC_THREADS_MAX 8
+
+struct jpeg_enc;
+
+/* threads 0 uses every online cpu */
+struct jpeg_enc *jpeg_enc_create(int width, int height, unsigned int fcc,
+                                 int threads);
+void jpeg_enc_destroy(struct jpeg_enc *j);
+/* libjpeg quality, 1-100 */
+void jpeg_enc_set_quality(struct jpeg_enc *j, int quality);
+/* data stays valid until the next call */
+int jpeg_enc_encode(struct jpeg_enc *j, const void *src, void **data, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,13 @@
 
 #include "mpi_enc.h"
 #include <linux/videodev2.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#ifndef V4L2_PIX_FMT_HEVC
+#define V4L2_PIX_FMT_HEVC v4l2_fourcc('H', 'E', 'V', 'C')
+#endif
 
 #if 0
 static OptionInfo mpi_enc_cmd[] = {
@@ -30,6 +37,26 @@ static OptionInfo mpi_enc_cmd[] = {
 };
 #endif
 static MppFrameFormat g_format = MPP_FMT_YUV420SP;
+static RK_U32 g_low_latency = 0;
+
+static void test_ctx_set_size(MpiEncTestData *p, RK_U32 width, RK_U32 height)
+{
+    p->width        = width;
+    p->height       = height;
+    p->hor_stride   = width;//MPP_ALIGN(width, 16);
+    p->ver_stride   = height;//MPP_ALIGN(height, 16);
+
+    // update resource parameter
+    if (p->fmt <= MPP_FMT_YUV420SP_VU)
+        p->frame_size = MPP_ALIGN(width, 16) * MPP_ALIGN(height, 16) * 2;
+    else if (p->fmt <= MPP_FMT_YUV422_UYVY) {
+        // NOTE: yuyv and uyvy need to double stride
+        p->hor_stride *= 2;
+        p->frame_size = p->hor_stride * p->ver_stride;
+    } else
+        p->frame_size = p->hor_stride * p->ver_stride * 4;
+    p->packet_size  = p->frame_size;//p->width * p->height;
+}
 
 static MPP_RET test_ctx_init(MpiEncTestData **data, MpiEncTestCmd *cmd)
 {
@@ -49,12 +76,10 @@ static MPP_RET test_ctx_init(MpiEncTestData **data, MpiEncTestCmd *cmd)
     }
 
     // get paramter from cmd
-    p->width        = cmd->width;
-    p->height       = cmd->height;
-    p->hor_stride   = cmd->width;//MPP_ALIGN(cmd->width, 16);
-    p->ver_stride   = cmd->height;//MPP_ALIGN(cmd->height, 16);
     p->fmt          = cmd->format;
     p->type         = cmd->type;
+    p->fps          = cmd->fps;
+    p->low_latency  = cmd->low_latency;
     if (cmd->type == MPP_VIDEO_CodingMJPEG)
         cmd->num_frames = 1;
     p->num_frames   = cmd->num_frames;
@@ -75,16 +100,7 @@ static MPP_RET test_ctx_init(MpiEncTestData **data, MpiEncTestCmd *cmd)
         }
     }
 
-    // update resource parameter
-    if (p->fmt <= MPP_FMT_YUV420SP_VU)
-        p->frame_size = MPP_ALIGN(cmd->width, 16) * MPP_ALIGN(cmd->height, 16) * 2;
-    else if (p->fmt <= MPP_FMT_YUV422_UYVY) {
-        // NOTE: yuyv and uyvy need to double stride
-        p->hor_stride *= 2;
-        p->frame_size = p->hor_stride * p->ver_stride;
-    } else
-        p->frame_size = p->hor_stride * p->ver_stride * 4;
-    p->packet_size  = p->frame_size;//p->width * p->height;
+    test_ctx_set_size(p, cmd->width, cmd->height);
 
 RET:
     *data = p;
@@ -117,6 +133,60 @@ static MPP_RET test_ctx_deinit(MpiEncTestData **data)
     return MPP_OK;
 }
 
+/* Fill rc_cfg from fps/gop/bps and the rc_mode/quality already set. */
+static void mpi_enc_fill_rc_cfg(MpiEncTestData *p)
+{
+    MppEncRcCfg *rc_cfg = &p->rc_cfg;
+
+    rc_cfg->change  = MPP_ENC_RC_CFG_CHANGE_ALL;
+
+    if (rc_cfg->rc_mode == MPP_ENC_RC_MODE_CBR) {
+        /* constant bitrate has very small bps range of 1/16 bps */
+        rc_cfg->bps_target   = p->bps;
+        rc_cfg->bps_max      = p->bps * 17 / 16;
+        rc_cfg->bps_min      = p->bps * 15 / 16;
+        if (p->low_latency) {
+            /* small VBV, every frame close to bps / fps */
+            rc_cfg->bps_max  = p->bps * 33 / 32;
+            rc_cfg->bps_min  = p->bps * 31 / 32;
+        }
+    } else if (rc_cfg->rc_mode ==  MPP_ENC_RC_MODE_VBR) {
+        if (rc_cfg->quality == MPP_ENC_RC_QUALITY_CQP) {
+            /* constant QP does not have bps */
+            rc_cfg->bps_target   = -1;
+            rc_cfg->bps_max      = -1;
+            rc_cfg->bps_min      = -1;
+        } else {
+            /* variable bitrate has large bps range */
+            rc_cfg->bps_target   = p->bps;
+            rc_cfg->bps_max      = p->bps * 17 / 16;
+            rc_cfg->bps_min      = p->bps * 1 / 16;
+        }
+    }
+
+    /* fix input / output frame rate */
+    rc_cfg->fps_in_flex      = 0;
+    rc_cfg->fps_in_num       = p->fps;
+    rc_cfg->fps_in_denorm    = 1;
+    rc_cfg->fps_out_flex     = 0;
+    rc_cfg->fps_out_num      = p->fps;
+    rc_cfg->fps_out_denorm   = 1;
+
+    rc_cfg->gop              = p->gop;
+    rc_cfg->skip_cnt         = 0;
+}
+
+/*
+ * Rows of blocks to intra code per frame so that the whole picture is
+ * refreshed about once a second.
+ */
+static RK_S32 mpi_enc_refresh_rows(MpiEncTestData *p, RK_U32 block)
+{
+    RK_S32 rows = (p->height + block - 1) / block;
+
+    return (rows + p->fps - 1) / p->fps;
+}
+
 static MPP_RET test_mpp_setup(MpiEncTestData *p)
 {
     MPP_RET ret;
@@ -136,9 +206,14 @@ static MPP_RET test_mpp_setup(MpiEncTestData *p)
     prep_cfg = &p->prep_cfg;
     rc_cfg = &p->rc_cfg;
 
-    /* setup default parameter */
-    p->fps = 30;
+    /* setup default parameter, fps follows the committed frame interval */
+    if (p->fps <= 0)
+        p->fps = 30;
     p->gop = 60;
+    /* intra refresh replaces the IDRs, keep one a minute as a fallback */
+    if (p->low_latency)
+        p->gop = p->fps * 60;
+    p->bps_auto = 1;
     p->bps = p->width * p->height / 8 * p->fps;
 
     prep_cfg->change        = MPP_ENC_PREP_CFG_CHANGE_INPUT |
@@ -162,39 +237,9 @@ static MPP_RET test_mpp_setup(MpiEncTestData *p)
         goto RET;
     }
 
-    rc_cfg->change  = MPP_ENC_RC_CFG_CHANGE_ALL;
     rc_cfg->rc_mode = MPP_ENC_RC_MODE_CBR;
     rc_cfg->quality = MPP_ENC_RC_QUALITY_MEDIUM;
-
-    if (rc_cfg->rc_mode == MPP_ENC_RC_MODE_CBR) {
-        /* constant bitrate has very small bps range of 1/16 bps */
-        rc_cfg->bps_target   = p->bps;
-        rc_cfg->bps_max      = p->bps * 17 / 16;
-        rc_cfg->bps_min      = p->bps * 15 / 16;
-    } else if (rc_cfg->rc_mode ==  MPP_ENC_RC_MODE_VBR) {
-        if (rc_cfg->quality == MPP_ENC_RC_QUALITY_CQP) {
-            /* constant QP does not have bps */
-            rc_cfg->bps_target   = -1;
-            rc_cfg->bps_max      = -1;
-            rc_cfg->bps_min      = -1;
-        } else {
-            /* variable bitrate has large bps range */
-            rc_cfg->bps_target   = p->bps;
-            rc_cfg->bps_max      = p->bps * 17 / 16;
-            rc_cfg->bps_min      = p->bps * 1 / 16;
-        }
-    }
-
-    /* fix input / output frame rate */
-    rc_cfg->fps_in_flex      = 0;
-    rc_cfg->fps_in_num       = p->fps;
-    rc_cfg->fps_in_denorm    = 1;
-    rc_cfg->fps_out_flex     = 0;
-    rc_cfg->fps_out_num      = p->fps;
-    rc_cfg->fps_out_denorm   = 1;
-
-    rc_cfg->gop              = p->gop;
-    rc_cfg->skip_cnt         = 0;
+    mpi_enc_fill_rc_cfg(p);
 
     printf("mpi_enc_test bps %d fps %d gop %d\n",
             rc_cfg->bps_target, rc_cfg->fps_out_num, rc_cfg->gop);
@@ -229,16 +274,33 @@ static MPP_RET test_mpp_setup(MpiEncTestData *p)
         codec_cfg->h264.entropy_coding_mode  = 1;
         codec_cfg->h264.cabac_init_idc  = 0;
         codec_cfg->h264.transform8x8_mode = 1;
+        if (p->low_latency & MPI_ENC_LOW_LATENCY_BASELINE) {
+            /* constrained baseline: CAVLC, no 8x8 transform */
+            codec_cfg->h264.profile = 66;
+            codec_cfg->h264.entropy_coding_mode = 0;
+            codec_cfg->h264.transform8x8_mode = 0;
+        }
+        /* the VPU encodes I and P frames only, there are no B-frames */
+        if (p->low_latency) {
+            codec_cfg->h264.change |= MPP_ENC_H264_CFG_CHANGE_INTRA_REFRESH;
+            codec_cfg->h264.intra_refresh_mode = 1; /* by MB rows */
+            codec_cfg->h264.intra_refresh_arg = mpi_enc_refresh_rows(p, 16);
+        }
     } break;
     case MPP_VIDEO_CodingMJPEG : {
         codec_cfg->jpeg.change  = MPP_ENC_JPEG_CFG_CHANGE_QP;
-        codec_cfg->jpeg.quant   = 7;
+        codec_cfg->jpeg.quant   = MPI_ENC_JPEG_QUANT;
     } break;
     case MPP_VIDEO_CodingVP8 : {
     } break;
     case MPP_VIDEO_CodingHEVC : {
         codec_cfg->h265.change = MPP_ENC_H265_CFG_INTRA_QP_CHANGE;
         codec_cfg->h265.intra_qp = 26;
+        if (p->low_latency) {
+            codec_cfg->h265.change |= MPP_ENC_H265_CFG_INTRA_REFRESH_CHANGE;
+            codec_cfg->h265.intra_refresh_mode = 1; /* by CTU rows */
+            codec_cfg->h265.intra_refresh_arg = mpi_enc_refresh_rows(p, 64);
+        }
     } break;
     default : {
         printf("support encoder coding type %d\n", codec_cfg->coding);
@@ -262,12 +324,430 @@ RET:
     return ret;
 }
 
+/*
+ * Update rate control on a running encoder. Only the fields selected in
+ * param->change are used; with bps 0 (the default) the bitrate follows
+ * w * h / 8 * fps, so changing fps also rescales the bitrate. With keep
+ * the values are recorded in rc_user for mpi_enc_pool_get.
+ */
+static MPP_RET mpi_enc_apply_rc(MpiEncTestData *p, const MpiEncRcParam *param,
+                                RK_U32 keep)
+{
+    MPP_RET ret = MPP_OK;
+    MppEncCodecCfg *codec_cfg = &p->codec_cfg;
+    RK_U32 change = param->change;
+
+    if (((change & MPI_ENC_RC_CHANGE_FPS) && param->fps <= 0) ||
+        ((change & MPI_ENC_RC_CHANGE_GOP) && param->gop <= 0) ||
+        ((change & MPI_ENC_RC_CHANGE_BPS) && param->bps < 0))
+        return MPP_ERR_VALUE;
+
+    if (change & MPI_ENC_RC_CHANGE_FPS)
+        p->fps = param->fps;
+    if (change & MPI_ENC_RC_CHANGE_GOP)
+        p->gop = param->gop;
+    if (change & MPI_ENC_RC_CHANGE_BPS) {
+        p->bps_auto = !param->bps;
+        p->bps = param->bps;
+    }
+    if (p->bps_auto)
+        p->bps = p->width * p->height / 8 * p->fps;
+    if (change & MPI_ENC_RC_CHANGE_MODE) {
+        p->rc_cfg.rc_mode = param->rc_mode;
+        p->rc_cfg.quality = param->quality;
+    }
+    if (keep) {
+        MpiEncRcParam *u = &p->rc_user;
+
+        if (change & MPI_ENC_RC_CHANGE_FPS)
+            u->fps = param->fps;
+        if (change & MPI_ENC_RC_CHANGE_GOP)
+            u->gop = param->gop;
+        if (change & MPI_ENC_RC_CHANGE_BPS)
+            u->bps = param->bps;
+        if (change & MPI_ENC_RC_CHANGE_MODE) {
+            u->rc_mode = param->rc_mode;
+            u->quality = param->quality;
+        }
+        u->change |= change & ~MPI_ENC_RC_CHANGE_QP;
+    }
+
+    if (change & (MPI_ENC_RC_CHANGE_FPS | MPI_ENC_RC_CHANGE_GOP |
+                  MPI_ENC_RC_CHANGE_BPS | MPI_ENC_RC_CHANGE_MODE)) {
+        mpi_enc_fill_rc_cfg(p);
+        printf("mpi_enc_set_rc bps %d fps %d gop %d\n",
+               p->rc_cfg.bps_target, p->rc_cfg.fps_out_num, p->rc_cfg.gop);
+        ret = p->mpi->control(p->ctx, MPP_ENC_SET_RC_CFG, &p->rc_cfg);
+        if (ret) {
+            printf("mpi control enc set rc cfg failed ret %d\n", ret);
+            return ret;
+        }
+        /* the VUI timing and HRD in the SPS follow the rate control */
+        p->extra_len = 0;
+    }
+
+    if (!(change & MPI_ENC_RC_CHANGE_QP))
+        return ret;
+    switch (p->type) {
+    case MPP_VIDEO_CodingMJPEG:
+        if (param->qp < 1 || param->qp > 10)
+            return MPP_ERR_VALUE;
+        codec_cfg->jpeg.change = MPP_ENC_JPEG_CFG_CHANGE_QP;
+        codec_cfg->jpeg.quant = param->qp;
+        break;
+    case MPP_VIDEO_CodingAVC:
+        if (param->qp < 0 || param->qp > 51)
+            return MPP_ERR_VALUE;
+        codec_cfg->h264.change = MPP_ENC_H264_CFG_CHANGE_QP_LIMIT;
+        codec_cfg->h264.qp_init = param->qp;
+        if (p->rc_cfg.quality == MPP_ENC_RC_QUALITY_CQP) {
+            codec_cfg->h264.qp_min = param->qp;
+            codec_cfg->h264.qp_max = param->qp;
+        } else {
+            codec_cfg->h264.qp_min = 10;
+            codec_cfg->h264.qp_max = 51;
+        }
+        codec_cfg->h264.qp_max_step = 8;
+        break;
+    case MPP_VIDEO_CodingHEVC:
+        if (param->qp < 0 || param->qp > 51)
+            return MPP_ERR_VALUE;
+        codec_cfg->h265.change = MPP_ENC_H265_CFG_INTRA_QP_CHANGE;
+        codec_cfg->h265.intra_qp = param->qp;
+        break;
+    default:
+        return MPP_ERR_VALUE;
+    }
+    ret = p->mpi->control(p->ctx, MPP_ENC_SET_CODEC_CFG, codec_cfg);
+    if (ret) {
+        printf("mpi control enc set codec cfg failed ret %d\n", ret);
+        return ret;
+    }
+    if (keep) {
+        p->rc_user.change |= MPI_ENC_RC_CHANGE_QP;
+        p->rc_user.qp = param->qp;
+    }
+
+    return ret;
+}
+
+MPP_RET mpi_enc_set_rc(MpiEncTestData *p, const MpiEncRcParam *param)
+{
+    return mpi_enc_apply_rc(p, param, 1);
+}
+
+MPP_RET mpi_enc_set_quant(MpiEncTestData *p, RK_S32 qp)
+{
+    MpiEncRcParam param;
+
+    memset(&param, 0, sizeof(param));
+    param.change = MPI_ENC_RC_CHANGE_QP;
+    param.qp = qp;
+
+    return mpi_enc_apply_rc(p, &param, 0);
+}
+
+void mpi_enc_flush_import_cache(MpiEncTestData *p)
+{
+    int i;
+
+    for (i = 0; i < MPI_ENC_IMPORT_CACHE_SIZE; i++) {
+        MpiEncImportBuf *c = &p->import_cache[i];
+
+        if (c->buf)
+            mpp_buffer_put(c->buf);
+        memset(c, 0, sizeof(*c));
+        c->fd = -1;
+    }
+    p->import_next = 0;
+}
+
+/* Look up the MppBuffer for a camera fd, importing it on first use. */
+static MPP_RET mpi_enc_import(MpiEncTestData *p, int fd, size_t size,
+                              MppBuffer *buf)
+{
+    MPP_RET ret;
+    MpiEncImportBuf *c = NULL;
+    MppBufferInfo inputCommit;
+    struct stat st;
+    int i;
+
+    if (fstat(fd, &st)) {
+        printf("fstat input fd %d failed\n", fd);
+        return MPP_NOK;
+    }
+
+    for (i = 0; i < MPI_ENC_IMPORT_CACHE_SIZE; i++) {
+        MpiEncImportBuf *e = &p->import_cache[i];
+
+        if (!e->buf || e->fd != fd)
+            continue;
+        if (e->size == size && e->dev == st.st_dev && e->ino == st.st_ino) {
+            *buf = e->buf;
+            return MPP_OK;
+        }
+        /* fd was closed and reused for another buffer */
+        c = e;
+        break;
+    }
+    if (!c) {
+        for (i = 0; i < MPI_ENC_IMPORT_CACHE_SIZE; i++) {
+            if (!p->import_cache[i].buf) {
+                c = &p->import_cache[i];
+                break;
+            }
+        }
+    }
+    if (!c) {
+        c = &p->import_cache[p->import_next];
+        p->import_next = (p->import_next + 1) % MPI_ENC_IMPORT_CACHE_SIZE;
+    }
+    if (c->buf) {
+        mpp_buffer_put(c->buf);
+        c->buf = NULL;
+    }
+
+    memset(&inputCommit, 0, sizeof(inputCommit));
+    inputCommit.type = MPP_BUFFER_TYPE_ION;
+    inputCommit.size = size;
+    inputCommit.fd = fd;
+    ret = mpp_buffer_import(&c->buf, &inputCommit);
+    if (ret) {
+        c->buf = NULL;
+        return ret;
+    }
+    c->fd = fd;
+    c->size = size;
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    *buf = c->buf;
+
+    return MPP_OK;
+}
+
+/*
+ * Let the encoder write into count buffers of our own, used round robin,
+ * instead of allocating a packet per frame. enc_data of a frame stays
+ * valid until count - 1 more frames have been encoded. 0 frees the pool.
+ */
+MPP_RET mpi_enc_set_output_pool(MpiEncTestData *p, int count)
+{
+    MPP_RET ret;
+    int i;
+
+    if (count < 0 || count > MPI_ENC_PKT_BUF_MAX)
+        return MPP_ERR_VALUE;
+    /* kept by a pooled encoder and still large enough */
+    if (count && count == (int)p->pkt_buf_count &&
+        mpp_buffer_get_size(p->pkt_bufs[0]) >= p->packet_size) {
+        p->pkt_buf_index = 0;
+        return MPP_OK;
+    }
+    for (i = 0; i < (int)p->pkt_buf_count; i++) {
+        mpp_buffer_put(p->pkt_bufs[i]);
+        p->pkt_bufs[i] = NULL;
+    }
+    p->pkt_buf_count = 0;
+    p->pkt_buf_index = 0;
+    if (!count) {
+        if (p->pkt_grp) {
+            mpp_buffer_group_put(p->pkt_grp);
+            p->pkt_grp = NULL;
+        }
+        return MPP_OK;
+    }
+
+    if (!p->pkt_grp) {
+        ret = mpp_buffer_group_get_internal(&p->pkt_grp, MPP_BUFFER_TYPE_ION);
+        if (ret) {
+            printf("failed to get buffer group for output packet ret %d\n", ret);
+            return ret;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        ret = mpp_buffer_get(p->pkt_grp, &p->pkt_bufs[i], p->packet_size);
+        if (ret) {
+            printf("failed to get buffer for output packet ret %d\n", ret);
+            mpi_enc_set_output_pool(p, 0);
+            return ret;
+        }
+        p->pkt_buf_count++;
+    }
+
+    return MPP_OK;
+}
+
+/*
+ * Encode into a buffer owned by the caller (e.g. an imported dma-buf)
+ * until it is replaced or cleared with NULL. The buffer must hold a
+ * whole packet, packet_size bytes.
+ */
+MPP_RET mpi_enc_set_output_buffer(MpiEncTestData *p, MppBuffer buf)
+{
+    if (buf && mpp_buffer_get_size(buf) < p->packet_size)
+        printf("output buffer smaller than packet size %zu\n", p->packet_size);
+    p->ext_pkt_buf = buf;
+    return MPP_OK;
+}
+
+/*
+ * A packet as long as the buffer it was written into has been cut short
+ * by mpp. Count it and grow the pooled buffers before the next frame.
+ * In async mode this runs on the collect thread, hence the atomics.
+ */
+static bool mpi_enc_packet_overflow(MpiEncTestData *p, MppPacket packet)
+{
+    MppBuffer buf = mpp_packet_get_buffer(packet);
+    size_t len = mpp_packet_get_length(packet);
+    size_t max = __atomic_load_n(&p->enc_len_max, __ATOMIC_RELAXED);
+    RK_U32 count;
+
+    while (len > max &&
+           !__atomic_compare_exchange_n(&p->enc_len_max, &max, len, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    if (!buf || len < mpp_buffer_get_size(buf))
+        return false;
+    count = __atomic_add_fetch(&p->overflow_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->pkt_grow, 1, __ATOMIC_RELEASE);
+    printf("mpp packet filled its %zu byte buffer, dropped (%u)\n",
+           mpp_buffer_get_size(buf), count);
+    return true;
+}
+
+/*
+ * Largest packet worth growing the output buffers for, normally the
+ * dwMaxVideoFrameSize the host committed. 0 for twice the frame size.
+ */
+void mpi_enc_set_max_packet(MpiEncTestData *p, size_t size)
+{
+    __atomic_store_n(&p->packet_max, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Double the pooled output buffers, up to packet_max. Only call it when
+ * no packet still points into the old buffers.
+ */
+static void mpi_enc_grow_packet(MpiEncTestData *p)
+{
+    size_t max = __atomic_load_n(&p->packet_max, __ATOMIC_RELAXED);
+    size_t size;
+
+    if (!max)
+        max = p->frame_size * 2;
+    size = MPP_MIN(p->packet_size * 2, max);
+    if (!p->pkt_buf_count || size <= p->packet_size)
+        return;
+    p->packet_size = size;
+    if (mpi_enc_set_output_pool(p, p->pkt_buf_count))
+        printf("grow output packet to %zu failed\n", size);
+    else
+        printf("output packet grown to %zu\n", size);
+}
+
+static MppBuffer mpi_enc_next_output(MpiEncTestData *p)
+{
+    MppBuffer buf;
+
+    if (p->ext_pkt_buf)
+        return p->ext_pkt_buf;
+    if (!p->pkt_buf_count)
+        return NULL;
+    buf = p->pkt_bufs[p->pkt_buf_index];
+    p->pkt_buf_index = (p->pkt_buf_index + 1) % p->pkt_buf_count;
+    return buf;
+}
+
+/*
+ * Copy the regions into the next roi_cfg slot, which stays untouched
+ * until the frames in flight with the older slots are encoded.
+ */
+static MppEncROICfg *mpi_enc_roi_cfg(MpiEncTestData *p,
+                                     const MpiEncRoiRegion *roi, RK_U32 count)
+{
+    MppEncROICfg *cfg = &p->roi_cfg[p->roi_index];
+    MppEncROIRegion *r = p->roi_regions[p->roi_index];
+    RK_U32 i;
+
+    p->roi_index = (p->roi_index + 1) % (MPI_ENC_ASYNC_DEPTH + 1);
+    memset(r, 0, sizeof(*r) * count);
+    for (i = 0; i < count; i++) {
+        r[i].x = roi[i].x;
+        r[i].y = roi[i].y;
+        r[i].w = roi[i].w;
+        r[i].h = roi[i].h;
+        r[i].intra = roi[i].intra;
+        /* mpp reads quality as a signed delta unless abs_qp_en */
+        r[i].quality = (RK_U16)roi[i].qp;
+        r[i].abs_qp_en = roi[i].abs_qp;
+        r[i].area_map_en = 1;
+        r[i].qp_area_idx = 0;
+    }
+    cfg->number = count;
+    cfg->regions = r;
+
+    return cfg;
+}
+
+/* out NULL lets mpp allocate the packet */
+static MPP_RET mpi_enc_put_frame(MpiEncTestData *p, int fd, size_t size,
+                                 MppBuffer out, const MpiEncRoiRegion *roi,
+                                 RK_U32 roi_count)
+{
+    MPP_RET ret;
+    MppFrame frame = NULL;
+    MppBuffer buf = NULL;
+
+    ret = mpp_frame_init(&frame);
+    if (ret) {
+        printf("mpp_frame_init failed\n");
+        return ret;
+    }
+
+    mpp_frame_set_width(frame, p->width);
+    mpp_frame_set_height(frame, p->height);
+    mpp_frame_set_hor_stride(frame, p->hor_stride);
+    mpp_frame_set_ver_stride(frame, p->ver_stride);
+    mpp_frame_set_fmt(frame, p->fmt);
+#if 0
+    mpp_frame_set_buffer(frame, p->frm_buf);
+#else
+    ret = mpi_enc_import(p, fd, size, &buf);
+    if (ret) {
+        printf("import input picture buffer failed\n");
+        return ret;
+    }
+    mpp_frame_set_buffer(frame, buf);
+#endif
+    mpp_frame_set_eos(frame, p->frm_eos);
+
+    if (out) {
+        MppPacket packet = NULL;
+
+        /* returned by encode_get_packet, deinit there */
+        ret = mpp_packet_init_with_buffer(&packet, out);
+        if (ret) {
+            printf("mpp_packet_init_with_buffer failed\n");
+            return ret;
+        }
+        mpp_packet_set_length(packet, 0);
+        mpp_meta_set_packet(mpp_frame_get_meta(frame), KEY_OUTPUT_PACKET, packet);
+    }
+    if (roi_count)
+        mpp_meta_set_ptr(mpp_frame_get_meta(frame), KEY_ROI_DATA,
+                         mpi_enc_roi_cfg(p, roi, roi_count));
+
+    ret = p->mpi->encode_put_frame(p->ctx, frame);
+    if (ret)
+        printf("mpp encode put frame failed\n");
+    return ret;
+}
+
 static MPP_RET test_mpp_run(MpiEncTestData *p, int fd, size_t size)
 {
     MPP_RET ret;
     MppApi *mpi;
     MppCtx ctx;
-    MppBuffer buf = NULL;
 
     if (NULL == p)
         return MPP_ERR_NULL_PTR;
@@ -296,45 +776,17 @@ static MPP_RET test_mpp_run(MpiEncTestData *p, int fd, size_t size)
     }
 
     do {
-        MppFrame frame = NULL;
-
         if (p->packet)
             mpp_packet_deinit(&p->packet);
         p->packet = NULL;
+        /* the old buffers are no longer referenced by a packet */
+        if (__atomic_exchange_n(&p->pkt_grow, 0, __ATOMIC_ACQ_REL))
+            mpi_enc_grow_packet(p);
 
-        ret = mpp_frame_init(&frame);
-        if (ret) {
-            printf("mpp_frame_init failed\n");
-            goto RET;
-        }
-
-        mpp_frame_set_width(frame, p->width);
-        mpp_frame_set_height(frame, p->height);
-        mpp_frame_set_hor_stride(frame, p->hor_stride);
-        mpp_frame_set_ver_stride(frame, p->ver_stride);
-        mpp_frame_set_fmt(frame, p->fmt);
-#if 0
-        mpp_frame_set_buffer(frame, p->frm_buf);
-#else
-        MppBufferInfo inputCommit;
-        memset(&inputCommit, 0, sizeof(inputCommit));
-        inputCommit.type = MPP_BUFFER_TYPE_ION;
-        inputCommit.size = size;
-        inputCommit.fd = fd;
-        ret = mpp_buffer_import(&buf, &inputCommit);
-        if (ret) {
-            printf("import input picture buffer failed\n");
-            goto RET;
-        }
-        mpp_frame_set_buffer(frame, buf);
-#endif
-        mpp_frame_set_eos(frame, p->frm_eos);
-
-        ret = mpi->encode_put_frame(ctx, frame);
-        if (ret) {
-            printf("mpp encode put frame failed\n");
+        ret = mpi_enc_put_frame(p, fd, size, mpi_enc_next_output(p),
+                                p->roi, p->roi_count);
+        if (ret)
             goto RET;
-        }
 
         ret = mpi->encode_get_packet(ctx, &p->packet);
         if (ret) {
@@ -348,6 +800,10 @@ static MPP_RET test_mpp_run(MpiEncTestData *p, int fd, size_t size)
             size_t len  = mpp_packet_get_length(p->packet);
 
             p->pkt_eos = mpp_packet_get_eos(p->packet);
+            if (mpi_enc_packet_overflow(p, p->packet)) {
+                ret = MPP_NOK;
+                goto RET;
+            }
 
             if (p->fp_output)
                 fwrite(ptr, 1, len, p->fp_output);
@@ -356,12 +812,115 @@ static MPP_RET test_mpp_run(MpiEncTestData *p, int fd, size_t size)
         }
     } while (0);
 RET:
+    return ret;
+}
+
+MPP_RET mpi_enc_set_split(MpiEncTestData *p, RK_U32 bytes)
+{
+    MppEncSliceSplit split;
+    MPP_RET ret;
+
+    if (p->type != MPP_VIDEO_CodingAVC && p->type != MPP_VIDEO_CodingHEVC)
+        return MPP_ERR_VALUE;
+
+    memset(&split, 0, sizeof(split));
+    split.change     = MPP_ENC_SPLIT_CFG_CHANGE_ALL;
+    split.split_mode = bytes ? MPP_ENC_SPLIT_BY_BYTE : MPP_ENC_SPLIT_NONE;
+    split.split_arg  = bytes;
+    split.split_out  = bytes ? MPP_ENC_SPLIT_OUT_LOWDELAY : 0;
+    ret = p->mpi->control(p->ctx, MPP_ENC_SET_SPLIT, &split);
+    if (ret) {
+        printf("mpi control enc set split failed ret %d\n", ret);
+        return ret;
+    }
+    p->split_bytes = bytes;
+
+    return MPP_OK;
+}
+
+MPP_RET mpi_enc_set_roi_regions(MpiEncTestData *p, const MpiEncRoiRegion *roi,
+                                RK_U32 count)
+{
+    RK_U32 i, n = 0;
+    RK_U32 x0, y0, x1, y1;
+
+    if (p->type != MPP_VIDEO_CodingAVC && p->type != MPP_VIDEO_CodingHEVC)
+        return MPP_ERR_VALUE;
+    if (count > MPI_ENC_ROI_MAX)
+        count = MPI_ENC_ROI_MAX;
+
+    for (i = 0; i < count; i++) {
+        x0 = roi[i].x & ~15;
+        y0 = roi[i].y & ~15;
+        x1 = MPP_MIN(MPP_ALIGN(roi[i].x + roi[i].w, 16), MPP_ALIGN(p->width, 16));
+        y1 = MPP_MIN(MPP_ALIGN(roi[i].y + roi[i].h, 16), MPP_ALIGN(p->height, 16));
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+        p->roi[n] = roi[i];
+        p->roi[n].x = x0;
+        p->roi[n].y = y0;
+        p->roi[n].w = x1 - x0;
+        p->roi[n].h = y1 - y0;
+        n++;
+    }
+    p->roi_count = n;
+
+    return MPP_OK;
+}
+
+MPP_RET mpi_enc_request_idr(MpiEncTestData *p)
+{
+    MPP_RET ret;
+
+    if (p->type != MPP_VIDEO_CodingAVC && p->type != MPP_VIDEO_CodingHEVC)
+        return MPP_ERR_VALUE;
+
+    ret = p->mpi->control(p->ctx, MPP_ENC_SET_IDR_FRAME, NULL);
+    if (ret)
+        printf("mpi control enc set idr frame failed ret %d\n", ret);
 
-    if (buf)
-        mpp_buffer_put(buf);
     return ret;
 }
 
+/*
+ * Encode one frame and hand every slice to cb as mpp returns it, without
+ * waiting for the whole frame. Slices are in mpp's own packets, the
+ * output pool is not used. cb gets data NULL and last set on failure.
+ */
+MPP_RET mpi_enc_run_slices(MpiEncTestData *p, int fd, size_t size,
+                           mpi_enc_slice_callback cb, void *user)
+{
+    MPP_RET ret;
+    MppPacket packet = NULL;
+    RK_U32 last = 0;
+
+    if (p->packet)
+        mpp_packet_deinit(&p->packet);
+
+    ret = mpi_enc_put_frame(p, fd, size, NULL, p->roi, p->roi_count);
+    if (ret) {
+        cb(NULL, 0, 1, user);
+        return ret;
+    }
+
+    while (!last) {
+        ret = p->mpi->encode_get_packet(p->ctx, &packet);
+        if (ret || !packet) {
+            printf("mpp encode get packet failed\n");
+            cb(NULL, 0, 1, user);
+            return ret ? ret : MPP_NOK;
+        }
+        /* without split (or an mpp without low delay output) one packet */
+        last = !p->split_bytes || !mpp_packet_is_partition(packet) ||
+               mpp_packet_is_eoi(packet);
+        cb(mpp_packet_get_pos(packet), mpp_packet_get_length(packet), last, user);
+        mpp_packet_deinit(&packet);
+    }
+    p->frame_count++;
+
+    return MPP_OK;
+}
+
 MPP_RET mpi_enc_test_init(MpiEncTestCmd *cmd, MpiEncTestData **data)
 {
     MPP_RET ret = MPP_OK;
@@ -405,6 +964,8 @@ MPP_RET mpi_enc_test_init(MpiEncTestCmd *cmd, MpiEncTestData **data)
         printf("test mpp setup failed ret %d\n", ret);
         return ret;
     }
+
+    return MPP_OK;
 }
 
 MPP_RET mpi_enc_test_run(MpiEncTestData **data, int fd, size_t size)
@@ -418,24 +979,253 @@ MPP_RET mpi_enc_test_run(MpiEncTestData **data, int fd, size_t size)
     return ret;
 }
 
+/*
+ * Pipelined encode: the submit thread feeds frames to the VPU while the
+ * collect thread drains packets of earlier frames, so the hardware gets
+ * the next frame as soon as it finishes the current one.
+ */
+typedef struct {
+    int fd;
+    size_t size;
+    void *frame_user;
+    /* p->roi when the frame was queued */
+    MpiEncRoiRegion roi[MPI_ENC_ROI_MAX];
+    RK_U32 roi_count;
+} MpiEncAsyncFrame;
+
+struct MpiEncAsync {
+    MpiEncTestData *p;
+    pthread_t submit_tid;
+    pthread_t collect_tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* frames waiting for (or in) encode_put_frame */
+    MpiEncAsyncFrame queue[MPI_ENC_ASYNC_DEPTH];
+    int queue_head;
+    int queue_count;
+    /* frames put to mpp whose packet is not collected yet */
+    void *pending[MPI_ENC_ASYNC_DEPTH];
+    int pending_head;
+    int pending_count;
+    bool stop;
+    bool submit_done;
+    mpi_enc_release_callback release_cb;
+    mpi_enc_packet_callback packet_cb;
+    void *user;
+};
+
+static void *mpi_enc_submit_thread(void *arg)
+{
+    struct MpiEncAsync *a = (struct MpiEncAsync *)arg;
+    MpiEncAsyncFrame f;
+    bool grow;
+    MPP_RET ret;
+
+    pthread_mutex_lock(&a->lock);
+    while (1) {
+        /* to grow the output buffers, let the packets in flight drain */
+        while (!a->stop && (!a->queue_count ||
+                            a->pending_count == MPI_ENC_ASYNC_DEPTH ||
+                            (a->pending_count &&
+                             __atomic_load_n(&a->p->pkt_grow, __ATOMIC_ACQUIRE))))
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (a->stop)
+            break;
+        f = a->queue[a->queue_head];
+        grow = !a->pending_count &&
+               __atomic_exchange_n(&a->p->pkt_grow, 0, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&a->lock);
+
+        /* only this thread adds packets in flight, there are none */
+        if (grow)
+            mpi_enc_grow_packet(a->p);
+
+        ret = mpi_enc_put_frame(a->p, f.fd, f.size, mpi_enc_next_output(a->p),
+                                f.roi, f.roi_count);
+        if (a->release_cb)
+            a->release_cb(f.frame_user, a->user);
+        if (ret && a->packet_cb)
+            a->packet_cb(NULL, 0, f.frame_user, a->user);
+
+        pthread_mutex_lock(&a->lock);
+        a->queue_head = (a->queue_head + 1) % MPI_ENC_ASYNC_DEPTH;
+        a->queue_count--;
+        if (!ret) {
+            a->pending[(a->pending_head + a->pending_count) % MPI_ENC_ASYNC_DEPTH] =
+                f.frame_user;
+            a->pending_count++;
+        }
+        pthread_cond_broadcast(&a->cond);
+    }
+    /* frames never handed to mpp */
+    while (a->queue_count) {
+        f = a->queue[a->queue_head];
+        a->queue_head = (a->queue_head + 1) % MPI_ENC_ASYNC_DEPTH;
+        a->queue_count--;
+        pthread_mutex_unlock(&a->lock);
+        if (a->release_cb)
+            a->release_cb(f.frame_user, a->user);
+        if (a->packet_cb)
+            a->packet_cb(NULL, 0, f.frame_user, a->user);
+        pthread_mutex_lock(&a->lock);
+    }
+    a->submit_done = true;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+static void *mpi_enc_collect_thread(void *arg)
+{
+    struct MpiEncAsync *a = (struct MpiEncAsync *)arg;
+    MppPacket packet;
+    void *frame_user;
+    MPP_RET ret;
+
+    pthread_mutex_lock(&a->lock);
+    while (1) {
+        while (!a->pending_count && !a->submit_done)
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (!a->pending_count)
+            break;
+        frame_user = a->pending[a->pending_head];
+        pthread_mutex_unlock(&a->lock);
+
+        packet = NULL;
+        ret = a->p->mpi->encode_get_packet(a->p->ctx, &packet);
+        if (ret)
+            printf("mpp encode get packet failed\n");
+        if (a->packet_cb) {
+            if (!ret && packet && !mpi_enc_packet_overflow(a->p, packet))
+                a->packet_cb(mpp_packet_get_pos(packet),
+                             mpp_packet_get_length(packet), frame_user, a->user);
+            else
+                a->packet_cb(NULL, 0, frame_user, a->user);
+        }
+        if (packet)
+            mpp_packet_deinit(&packet);
+
+        pthread_mutex_lock(&a->lock);
+        a->pending_head = (a->pending_head + 1) % MPI_ENC_ASYNC_DEPTH;
+        a->pending_count--;
+        pthread_cond_broadcast(&a->cond);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+MPP_RET mpi_enc_async_start(MpiEncTestData *p, mpi_enc_release_callback release_cb,
+                            mpi_enc_packet_callback packet_cb, void *user)
+{
+    struct MpiEncAsync *a;
+
+    if (!p || p->async)
+        return MPP_ERR_VALUE;
+    a = calloc(sizeof(*a), 1);
+    if (!a)
+        return MPP_ERR_MALLOC;
+    a->p = p;
+    a->release_cb = release_cb;
+    a->packet_cb = packet_cb;
+    a->user = user;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    if (pthread_create(&a->submit_tid, NULL, mpi_enc_submit_thread, a)) {
+        printf("create submit thread failed\n");
+        goto err;
+    }
+    if (pthread_create(&a->collect_tid, NULL, mpi_enc_collect_thread, a)) {
+        printf("create collect thread failed\n");
+        pthread_mutex_lock(&a->lock);
+        a->stop = true;
+        pthread_cond_broadcast(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+        pthread_join(a->submit_tid, NULL);
+        goto err;
+    }
+    p->async = a;
+
+    return MPP_OK;
+err:
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    return MPP_NOK;
+}
+
+MPP_RET mpi_enc_async_put(MpiEncTestData *p, int fd, size_t size, void *frame_user)
+{
+    struct MpiEncAsync *a = p ? p->async : NULL;
+    MpiEncAsyncFrame *f;
+
+    if (!a)
+        return MPP_ERR_NULL_PTR;
+    pthread_mutex_lock(&a->lock);
+    while (!a->stop && a->queue_count == MPI_ENC_ASYNC_DEPTH)
+        pthread_cond_wait(&a->cond, &a->lock);
+    if (a->stop) {
+        pthread_mutex_unlock(&a->lock);
+        return MPP_NOK;
+    }
+    f = &a->queue[(a->queue_head + a->queue_count) % MPI_ENC_ASYNC_DEPTH];
+    f->fd = fd;
+    f->size = size;
+    f->frame_user = frame_user;
+    f->roi_count = p->roi_count;
+    memcpy(f->roi, p->roi, sizeof(f->roi[0]) * p->roi_count);
+    a->queue_count++;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+
+    return MPP_OK;
+}
+
+/* Packets of frames already put are still delivered before returning. */
+void mpi_enc_async_stop(MpiEncTestData *p)
+{
+    struct MpiEncAsync *a = p ? p->async : NULL;
+
+    if (!a)
+        return;
+    pthread_mutex_lock(&a->lock);
+    a->stop = true;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->submit_tid, NULL);
+    pthread_join(a->collect_tid, NULL);
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    p->async = NULL;
+}
+
 MPP_RET mpi_enc_test_deinit(MpiEncTestData **data)
 {
     MPP_RET ret = MPP_OK;
     MpiEncTestData *p = *data;
 
+    mpi_enc_async_stop(p);
+
     if (p->packet)
         mpp_packet_deinit(&p->packet);
 
-    ret = p->mpi->reset(p->ctx);
-    if (ret) {
-        printf("mpi->reset failed\n");
-    }
-
     if (p->ctx) {
+        ret = p->mpi->reset(p->ctx);
+        if (ret) {
+            printf("mpi->reset failed\n");
+        }
         mpp_destroy(p->ctx);
         p->ctx = NULL;
     }
 
+    mpi_enc_flush_import_cache(p);
+    p->ext_pkt_buf = NULL;
+    mpi_enc_set_output_pool(p, 0);
+    free(p->extra_buf);
+    p->extra_buf = NULL;
+
 #if 0
     if (p->frm_buf) {
         mpp_buffer_put(p->frm_buf);
@@ -451,6 +1241,143 @@ MPP_RET mpi_enc_test_deinit(MpiEncTestData **data)
     return ret;
 }
 
+/*
+ * mpp_create/mpp_init are the slow part of starting a stream. Encoders
+ * of stopped streams are parked here, oldest first, and only set up
+ * again when a stream with the same type, size and input format starts.
+ */
+static MpiEncTestData *enc_pool[MPI_ENC_POOL_SIZE];
+static pthread_mutex_t enc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Prefer an encoder of the same size, else the newest one of the same
+ * type and format, which is then resized in place.
+ */
+static MpiEncTestData *mpi_enc_pool_take(MpiEncTestCmd *cmd)
+{
+    MpiEncTestData *p;
+    int i, found = -1;
+
+    pthread_mutex_lock(&enc_pool_lock);
+    for (i = 0; i < MPI_ENC_POOL_SIZE && enc_pool[i]; i++) {
+        p = enc_pool[i];
+        if (p->type != cmd->type || p->fmt != cmd->format ||
+            p->low_latency != cmd->low_latency)
+            continue;
+        found = i;
+        if (p->width == cmd->width && p->height == cmd->height)
+            break;
+    }
+    p = NULL;
+    if (found >= 0) {
+        p = enc_pool[found];
+        memmove(&enc_pool[found], &enc_pool[found + 1],
+                (MPI_ENC_POOL_SIZE - found - 1) * sizeof(enc_pool[0]));
+        enc_pool[MPI_ENC_POOL_SIZE - 1] = NULL;
+    }
+    pthread_mutex_unlock(&enc_pool_lock);
+
+    return p;
+}
+
+MPP_RET mpi_enc_pool_get(MpiEncTestCmd *cmd, MpiEncTestData **data)
+{
+    MPP_RET ret;
+    MpiEncTestData *p = mpi_enc_pool_take(cmd);
+    MpiEncRcParam rc;
+
+    if (!p)
+        return mpi_enc_test_init(cmd, data);
+
+    /* same defaults as a new encoder, at the fps of this stream */
+    if (p->fps != cmd->fps)
+        p->extra_len = 0;
+    p->fps = cmd->fps;
+    p->frame_count = 0;
+    p->stream_size = 0;
+    if (p->width != cmd->width || p->height != cmd->height) {
+        /* MPP_ENC_SET_PREP_CFG in test_mpp_setup applies the new size */
+        printf("%s: resize %dx%d -> %dx%d\n", __func__,
+               p->width, p->height, cmd->width, cmd->height);
+        test_ctx_set_size(p, cmd->width, cmd->height);
+        p->extra_len = 0;
+    }
+    ret = test_mpp_setup(p);
+    /* then what was set on the previous stream, except its fps */
+    rc = p->rc_user;
+    rc.change &= ~MPI_ENC_RC_CHANGE_FPS;
+    if (!ret && rc.change)
+        ret = mpi_enc_apply_rc(p, &rc, 0);
+    if (ret) {
+        printf("%s: setup failed ret %d, recreate\n", __func__, ret);
+        mpi_enc_test_deinit(&p);
+        return mpi_enc_test_init(cmd, data);
+    }
+    *data = p;
+
+    return MPP_OK;
+}
+
+void mpi_enc_pool_put(MpiEncTestData **data)
+{
+    MpiEncTestData *p = *data;
+    MpiEncTestData *old = NULL;
+    int i;
+
+    if (!p)
+        return;
+    *data = NULL;
+    if (!p->ctx) {
+        mpi_enc_test_deinit(&p);
+        return;
+    }
+
+    mpi_enc_async_stop(p);
+    if (p->packet)
+        mpp_packet_deinit(&p->packet);
+    if (p->split_bytes)
+        mpi_enc_set_split(p, 0);
+    p->roi_count = 0;
+    if (p->mpi->reset(p->ctx)) {
+        printf("mpi->reset failed\n");
+        mpi_enc_test_deinit(&p);
+        return;
+    }
+    /* the camera buffers of the next stream may be different */
+    mpi_enc_flush_import_cache(p);
+    p->ext_pkt_buf = NULL;
+
+    pthread_mutex_lock(&enc_pool_lock);
+    for (i = 0; i < MPI_ENC_POOL_SIZE && enc_pool[i]; i++)
+        ;
+    if (i == MPI_ENC_POOL_SIZE) {
+        old = enc_pool[0];
+        memmove(&enc_pool[0], &enc_pool[1],
+                (MPI_ENC_POOL_SIZE - 1) * sizeof(enc_pool[0]));
+        i = MPI_ENC_POOL_SIZE - 1;
+    }
+    enc_pool[i] = p;
+    pthread_mutex_unlock(&enc_pool_lock);
+
+    if (old)
+        mpi_enc_test_deinit(&old);
+}
+
+void mpi_enc_pool_clear(void)
+{
+    MpiEncTestData *pool[MPI_ENC_POOL_SIZE];
+    int i;
+
+    pthread_mutex_lock(&enc_pool_lock);
+    memcpy(pool, enc_pool, sizeof(pool));
+    memset(enc_pool, 0, sizeof(enc_pool));
+    pthread_mutex_unlock(&enc_pool_lock);
+
+    for (i = 0; i < MPI_ENC_POOL_SIZE; i++)
+        if (pool[i])
+            mpi_enc_test_deinit(&pool[i]);
+}
+
 static void mpi_enc_test_help()
 {
     printf("usage: mpi_enc_test [options]\n");
@@ -609,6 +1536,11 @@ void mpi_enc_cmd_config(MpiEncTestCmd *cmd, int width, int height,int fcc)
         break;
     case V4L2_PIX_FMT_H264:
         cmd->type = MPP_VIDEO_CodingAVC;
+        cmd->low_latency = g_low_latency;
+        break;
+    case V4L2_PIX_FMT_HEVC:
+        cmd->type = MPP_VIDEO_CodingHEVC;
+        cmd->low_latency = g_low_latency;
         break;
     default:
         printf("%s: not support fcc: %d\n", __func__, fcc);
@@ -638,7 +1570,33 @@ void mpi_enc_set_format(MppFrameFormat format)
 {
     g_format = format;
 }
-int mpi_enc_get_h264_extra(MpiEncTestData *p, void *buffer, size_t *size)
+
+void mpi_enc_set_low_latency(RK_U32 flags)
+{
+    g_low_latency = flags;
+}
+
+unsigned int mpi_enc_fmt_to_fcc(MppFrameFormat format)
+{
+    switch (format) {
+    case MPP_FMT_YUV420SP:
+        return V4L2_PIX_FMT_NV12;
+    case MPP_FMT_YUV420SP_VU:
+        return V4L2_PIX_FMT_NV21;
+    case MPP_FMT_YUV422SP:
+        return V4L2_PIX_FMT_NV16;
+    case MPP_FMT_YUV420P:
+        return V4L2_PIX_FMT_YUV420;
+    case MPP_FMT_YUV422_YUYV:
+        return V4L2_PIX_FMT_YUYV;
+    case MPP_FMT_YUV422_UYVY:
+        return V4L2_PIX_FMT_UYVY;
+    default:
+        printf("%s: not support format: %d\n", __func__, format);
+        return 0;
+    }
+}
+int mpi_enc_get_extra(MpiEncTestData *p, void *buffer, size_t *size)
 {
     MPP_RET ret;
     MppApi *mpi;
@@ -649,25 +1607,34 @@ int mpi_enc_get_h264_extra(MpiEncTestData *p, void *buffer, size_t *size)
     }
     mpi = p->mpi;
     ctx = p->ctx;
-    MppPacket packet = NULL;
-    ret = mpi->control(ctx, MPP_ENC_GET_EXTRA_INFO, &packet);
-    if (ret) {
-        printf("mpi control enc get extra info failed\n");
-        *size = 0;
-        return -1;
-    }
-    if (packet) {
-        void *ptr   = mpp_packet_get_pos(packet);
-        size_t len  = mpp_packet_get_length(packet);
-        printf("%s: len = %d\n", __func__, len);
-        if (*size >= len) {
-            memcpy(buffer, ptr, len);
-            *size = len;
-        } else {
-            printf("%s: input buffer size = %d\n", __func__, *size);
+    /* the headers only change with the size, keep them across restarts */
+    if (!p->extra_len) {
+        MppPacket packet = NULL;
+        ret = mpi->control(ctx, MPP_ENC_GET_EXTRA_INFO, &packet);
+        if (ret) {
+            printf("mpi control enc get extra info failed\n");
             *size = 0;
+            return -1;
         }
-        packet = NULL;
+        if (packet) {
+            void *ptr   = mpp_packet_get_pos(packet);
+            size_t len  = mpp_packet_get_length(packet);
+            void *buf   = realloc(p->extra_buf, len);
+            printf("%s: len = %d\n", __func__, len);
+            if (buf) {
+                memcpy(buf, ptr, len);
+                p->extra_buf = buf;
+                p->extra_len = len;
+            }
+            packet = NULL;
+        }
+    }
+    if (*size >= p->extra_len) {
+        memcpy(buffer, p->extra_buf, p->extra_len);
+        *size = p->extra_len;
+    } else {
+        printf("%s: input buffer size = %d\n", __func__, *size);
+        *size = 0;
     }
     return 0;
 }
@@ -30,6 +30,7 @@ extern "C" {
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <rockchip/rk_mpi.h>
 
 //#include "mpp_env.h"
@@ -41,6 +42,21 @@ extern "C" {
 //#include "utils.h"
 
 #define MAX_FILE_NAME_LENGTH        256
+/* rkisp/cif cycle through 4-6 buffers, leave some headroom */
+#define MPI_ENC_IMPORT_CACHE_SIZE   8
+/* frames queued to the async encoder, see mpi_enc_async_start */
+#define MPI_ENC_ASYNC_DEPTH         2
+/* output buffers rotated by mpi_enc_set_output_pool */
+#define MPI_ENC_PKT_BUF_MAX         8
+/* default JPEG quality, 1 (worst) to 10 (best) */
+#define MPI_ENC_JPEG_QUANT          7
+/* idle encoders kept for the next STREAMON, see mpi_enc_pool_get */
+#define MPI_ENC_POOL_SIZE           2
+/* regions of interest per frame, see mpi_enc_set_roi_regions */
+#define MPI_ENC_ROI_MAX             8
+/* H.264/H.265 presets, see mpi_enc_set_low_latency */
+#define MPI_ENC_LOW_LATENCY         (1 << 0)
+#define MPI_ENC_LOW_LATENCY_BASELINE (1 << 1)
 
 typedef struct {
     char            file_input[MAX_FILE_NAME_LENGTH];
@@ -49,13 +65,70 @@ typedef struct {
     RK_U32          width;
     RK_U32          height;
     MppFrameFormat  format;
+    RK_U32          fps;
     RK_U32          debug;
     RK_U32          num_frames;
+    RK_U32          low_latency;
 
     RK_U32          have_input;
     RK_U32          have_output;
 } MpiEncTestCmd;
 
+/*
+ * An input dma-buf imported into MPP. The camera reuses the same fds
+ * every frame, so the import is kept until the stream stops. fd numbers
+ * can be recycled after close, hence the inode check.
+ */
+typedef struct {
+    int fd;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    MppBuffer buf;
+} MpiEncImportBuf;
+
+#define MPI_ENC_RC_CHANGE_FPS       (1 << 0)
+#define MPI_ENC_RC_CHANGE_GOP       (1 << 1)
+#define MPI_ENC_RC_CHANGE_BPS       (1 << 2)
+#define MPI_ENC_RC_CHANGE_MODE      (1 << 3)
+#define MPI_ENC_RC_CHANGE_QP        (1 << 4)
+
+/* Runtime rate control, see mpi_enc_set_rc. */
+typedef struct MpiEncRcParam {
+    RK_U32          change;
+    RK_S32          fps;
+    RK_S32          gop;
+    /* 0 derives the bitrate from the size and fps */
+    RK_S32          bps;
+    MppEncRcMode    rc_mode;
+    MppEncRcQuality quality;
+    /* JPEG quant 1-10, H.264/H.265 qp 0-51 */
+    RK_S32          qp;
+} MpiEncRcParam;
+
+/* A rectangle of the encoder input coded at its own qp. */
+typedef struct MpiEncRoiRegion {
+    RK_U16          x;
+    RK_U16          y;
+    RK_U16          w;
+    RK_U16          h;
+    /* delta to the frame qp, negative is sharper; absolute with abs_qp */
+    RK_S16          qp;
+    RK_U8           abs_qp;
+    /* code the region intra */
+    RK_U8           intra;
+} MpiEncRoiRegion;
+
+/* The input fd of frame_user may be reused once this returns. */
+typedef void (*mpi_enc_release_callback)(void *frame_user, void *user);
+/* Called once per queued frame, with data NULL when encoding failed. */
+typedef void (*mpi_enc_packet_callback)(void *data, size_t len,
+                                        void *frame_user, void *user);
+/* One slice of a frame, last set on the final slice. */
+typedef void (*mpi_enc_slice_callback)(void *data, size_t len, RK_U32 last,
+                                       void *user);
+struct MpiEncAsync;
+
 typedef struct {
     // global flow control flag
     RK_U32 frm_eos;
@@ -76,6 +149,16 @@ typedef struct {
 
     // input / output
     MppBuffer frm_buf;
+    MpiEncImportBuf import_cache[MPI_ENC_IMPORT_CACHE_SIZE];
+    RK_U32 import_next;
+    MppBufferGroup pkt_grp;
+    MppBuffer pkt_bufs[MPI_ENC_PKT_BUF_MAX];
+    RK_U32 pkt_buf_count;
+    RK_U32 pkt_buf_index;
+    MppBuffer ext_pkt_buf;
+    /* cached MPP_ENC_GET_EXTRA_INFO, see mpi_enc_get_extra */
+    void *extra_buf;
+    size_t extra_len;
     MppEncSeiMode sei_mode;
 
     // paramter for resource malloc
@@ -86,29 +169,98 @@ typedef struct {
     MppFrameFormat fmt;
     MppCodingType type;
     RK_U32 num_frames;
+    RK_U32 low_latency;
 
     // resources
     size_t frame_size;
-    /* NOTE: packet buffer may overflow */
+    /*
+     * output buffer size, grown by mpi_enc_grow_packet when a packet
+     * fills its buffer (mpp then truncates it)
+     */
     size_t packet_size;
+    /* growth limit, see mpi_enc_set_max_packet */
+    size_t packet_max;
+    /* also written by the async collect thread, use __atomic_* */
+    RK_U32 pkt_grow;
+    RK_U32 overflow_count;
+    size_t enc_len_max;
 
     // rate control runtime parameter
+    /* what mpi_enc_set_rc changed, applied again when the pool reuses us */
+    MpiEncRcParam rc_user;
     RK_S32 gop;
     RK_S32 fps;
     RK_S32 bps;
+    RK_U32 bps_auto;
     MppPacket packet;
     void *enc_data;
     size_t enc_len;
+    struct MpiEncAsync *async;
+    /* slice size in low delay split mode, 0 for whole frames */
+    RK_U32 split_bytes;
+    /* regions for the frames put next, see mpi_enc_set_roi_regions */
+    MpiEncRoiRegion roi[MPI_ENC_ROI_MAX];
+    RK_U32 roi_count;
+    /* handed to mpp with a frame, one per frame that can be in flight */
+    MppEncROICfg roi_cfg[MPI_ENC_ASYNC_DEPTH + 1];
+    MppEncROIRegion roi_regions[MPI_ENC_ASYNC_DEPTH + 1][MPI_ENC_ROI_MAX];
+    RK_U32 roi_index;
 } MpiEncTestData;
 
 MPP_RET mpi_enc_test_init(MpiEncTestCmd *cmd, MpiEncTestData **data);
 MPP_RET mpi_enc_test_run(MpiEncTestData **data, int fd, size_t size);
 MPP_RET mpi_enc_test_deinit(MpiEncTestData **data);
+/*
+ * Like mpi_enc_test_init/deinit, but put parks the encoder and get reuses
+ * a parked one of the same type, size and format when there is one.
+ */
+MPP_RET mpi_enc_pool_get(MpiEncTestCmd *cmd, MpiEncTestData **data);
+void mpi_enc_pool_put(MpiEncTestData **data);
+void mpi_enc_pool_clear(void);
+void mpi_enc_flush_import_cache(MpiEncTestData *p);
+MPP_RET mpi_enc_set_rc(MpiEncTestData *p, const MpiEncRcParam *param);
+/*
+ * Quant/qp of the running encoder only, e.g. for adaptive quant. Unlike
+ * mpi_enc_set_rc it is not applied again when the encoder is reused.
+ */
+MPP_RET mpi_enc_set_quant(MpiEncTestData *p, RK_S32 qp);
+MPP_RET mpi_enc_set_output_pool(MpiEncTestData *p, int count);
+MPP_RET mpi_enc_set_output_buffer(MpiEncTestData *p, MppBuffer buf);
+void mpi_enc_set_max_packet(MpiEncTestData *p, size_t size);
+/*
+ * Split H.264/H.265 frames into slices of about bytes each, returned one
+ * by one as they are encoded (MPP_ENC_SPLIT_OUT_LOWDELAY). 0 turns it off.
+ */
+MPP_RET mpi_enc_set_split(MpiEncTestData *p, RK_U32 bytes);
+/*
+ * Code these regions of the H.264/H.265 input at their own qp, from the
+ * next frame put until replaced. count 0 clears them. Regions are
+ * aligned out to 16 pixels and clipped to the frame.
+ */
+MPP_RET mpi_enc_set_roi_regions(MpiEncTestData *p, const MpiEncRoiRegion *roi,
+                                RK_U32 count);
+/* Make the next H.264/H.265 frame put to the encoder an IDR frame. */
+MPP_RET mpi_enc_request_idr(MpiEncTestData *p);
+MPP_RET mpi_enc_run_slices(MpiEncTestData *p, int fd, size_t size,
+                           mpi_enc_slice_callback cb, void *user);
+MPP_RET mpi_enc_async_start(MpiEncTestData *p, mpi_enc_release_callback release_cb,
+                            mpi_enc_packet_callback packet_cb, void *user);
+MPP_RET mpi_enc_async_put(MpiEncTestData *p, int fd, size_t size, void *frame_user);
+void mpi_enc_async_stop(MpiEncTestData *p);
 void mpi_enc_cmd_config(MpiEncTestCmd *cmd, int width, int height,int fcc);
 void mpi_enc_cmd_config_mjpg(MpiEncTestCmd *cmd, int width, int height);
 void mpi_enc_cmd_config_h264(MpiEncTestCmd *cmd, int width, int height);
 void mpi_enc_set_format(MppFrameFormat format);
-int mpi_enc_get_h264_extra(MpiEncTestData *p, void *buffer, size_t *size);
+/*
+ * MPI_ENC_LOW_LATENCY: intra refresh instead of periodic IDRs and a tight
+ * CBR window, so every frame is about bps / fps. With
+ * MPI_ENC_LOW_LATENCY_BASELINE H.264 is constrained baseline. Used by
+ * encoders configured after the call.
+ */
+void mpi_enc_set_low_latency(RK_U32 flags);
+unsigned int mpi_enc_fmt_to_fcc(MppFrameFormat format);
+/* stream headers: SPS/PPS for H.264, VPS/SPS/PPS for H.265 */
+int mpi_enc_get_extra(MpiEncTestData *p, void *buffer, size_t *size);
 
 #ifdef __cplusplus
 }
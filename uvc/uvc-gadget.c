@@ -135,6 +135,23 @@
 #define PU_HUE_AUTO_STEP_SIZE       1
 #define PU_HUE_AUTO_DEFAULT_VAL     127
 
+/*
+ * Digital zoom/pan/tilt on the camera terminal, implemented as a crop of
+ * the camera frame (see uvc_control_set_zoom/uvc_control_set_pantilt).
+ */
+#define CT_ZOOM_MIN_VAL             UVC_ZOOM_MIN
+#define CT_ZOOM_MAX_VAL             UVC_ZOOM_MAX
+#define CT_ZOOM_STEP_SIZE           1
+#define CT_ZOOM_DEFAULT_VAL         UVC_ZOOM_MIN
+
+#define CT_PANTILT_MIN_VAL          (-UVC_PAN_TILT_MAX)
+#define CT_PANTILT_MAX_VAL          UVC_PAN_TILT_MAX
+#define CT_PANTILT_STEP_SIZE        3600
+#define CT_PANTILT_DEFAULT_VAL      0
+
+/* first byte of an extension unit control 2 SET_CUR */
+#define XU_CMD_REQUEST_IDR          0x01
+
 /* ---------------------------------------------------------------------------
  * UVC specific stuff
  */
@@ -172,10 +189,20 @@ static const struct uvc_frame_info uvc_frames_h264[] = {
     { 0, 0, { 0, }, },
 };
 
+static const struct uvc_frame_info uvc_frames_h265[] = {
+    {  640, 480, { 333333, 400000, 500000, 666666, 1000000, 2000000, 0 }, },
+    { 1280, 720, { 333333, 400000, 500000, 666666, 1000000, 2000000, 0 }, },
+    { 1920, 1080, { 333333, 400000, 500000, 666666, 1000000, 2000000, 0 }, },
+    { 2560, 1440, { 333333, 400000, 500000, 666666, 1000000, 2000000, 0 }, },
+    { 0, 0, { 0, }, },
+};
+
+/* Order must match the format links in uvc_config.sh (u, m, f, f2). */
 static const struct uvc_format_info uvc_formats[] = {
     { V4L2_PIX_FMT_YUYV, uvc_frames_yuyv },
     { V4L2_PIX_FMT_MJPEG, uvc_frames_mjpeg },
     { V4L2_PIX_FMT_H264, uvc_frames_h264 },
+    { V4L2_PIX_FMT_HEVC, uvc_frames_h265 },
 };
 
 /* ---------------------------------------------------------------------------
@@ -755,7 +782,7 @@ uvc_video_set_format(struct uvc_device *dev)
     fmt.fmt.pix.field = V4L2_FIELD_NONE;
     if (dev->fcc == V4L2_PIX_FMT_MJPEG)
         fmt.fmt.pix.sizeimage = dev->imgsize * 2/*1.5*/;
-    if (dev->fcc == V4L2_PIX_FMT_H264)
+    if (dev->fcc == V4L2_PIX_FMT_H264 || dev->fcc == V4L2_PIX_FMT_HEVC)
         fmt.fmt.pix.sizeimage = dev->width * dev->height * 2;
 
     ret = ioctl(dev->uvc_fd, VIDIOC_S_FMT, &fmt);
@@ -885,6 +912,9 @@ uvc_open(struct uvc_device **uvc, char *devname)
     dev->gain_val = PU_GAIN_DEFAULT_VAL;
     dev->hue_auto_val = PU_HUE_AUTO_DEFAULT_VAL;
     dev->power_line_frequency_val = V4L2_CID_POWER_LINE_FREQUENCY_50HZ;
+    dev->zoom_val = CT_ZOOM_DEFAULT_VAL;
+    dev->pan_val = CT_PANTILT_DEFAULT_VAL;
+    dev->tilt_val = CT_PANTILT_DEFAULT_VAL;
 
     *uvc = dev;
 
@@ -927,6 +957,7 @@ uvc_video_fill_buffer(struct uvc_device *dev, struct v4l2_buffer *buf)
 
     case V4L2_PIX_FMT_MJPEG:
     case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
         memcpy(dev->mem[buf->index].start, dev->imgdata, dev->imgsize);
         buf->bytesused = dev->imgsize;
         break;
@@ -1281,6 +1312,7 @@ uvc_video_reqbufs_userptr(struct uvc_device *dev, int nbufs)
             break;
         case V4L2_PIX_FMT_MJPEG:
         case V4L2_PIX_FMT_H264:
+        case V4L2_PIX_FMT_HEVC:
             payload_size = dev->imgsize;
             break;
         default:
@@ -1336,6 +1368,29 @@ uvc_video_reqbufs(struct uvc_device *dev, int nbufs)
     return ret;
 }
 
+static void
+uvc_handle_streamoff_event(struct uvc_device *dev)
+{
+    /* Stop V4L2 streaming... */
+    if (!dev->run_standalone && dev->vdev->is_streaming) {
+        /* UVC - V4L2 integrated path. */
+        v4l2_stop_capturing(dev->vdev);
+        dev->vdev->is_streaming = 0;
+    }
+
+    /* ... and now UVC streaming.. */
+    if (dev->is_streaming) {
+        uvc_video_stream(dev, 0);
+        uvc_uninit_device(dev);
+        uvc_video_reqbufs(dev, 0);
+        dev->is_streaming = 0;
+        dev->first_buffer_queued = 0;
+    }
+
+    uvc_buffer_deinit(dev->video_id);
+    uvc_control_exit(dev->video_id);
+}
+
 /*
  * This function is called in response to either:
  *  - A SET_ALT(interface 1, alt setting 1) command from USB host,
@@ -1391,7 +1446,12 @@ uvc_handle_streamon_event(struct uvc_device *dev)
         dev->is_streaming = 1;
     }
 
-    uvc_control_init(dev->width, dev->height, dev->fcc);
+    if (uvc_control_init(dev->video_id, dev->width, dev->height, dev->fcc,
+                         dev->fps)) {
+        /* no encoder for this function, the others keep streaming */
+        uvc_handle_streamoff_event(dev);
+        return -EBUSY;
+    }
     return 0;
 
 err:
@@ -1402,6 +1462,29 @@ err:
  * UVC Request processing
  */
 
+/*
+ * Payload bytes per second the streaming endpoint can move: the isoc
+ * reservation per (micro)frame, or the most bulk packets a (micro)frame
+ * can hold. 0 when there is no useful bound (super speed bulk).
+ */
+static unsigned int
+uvc_video_link_rate(struct uvc_device *dev)
+{
+    unsigned int per_frame;
+    unsigned int frames = dev->speed == USB_SPEED_FULL ? 1000 : 8000;
+
+    if (!dev->bulk)
+        per_frame = dev->maxpkt * (dev->mult + 1) * (dev->burst + 1);
+    else if (dev->speed == USB_SPEED_HIGH)
+        per_frame = 13 * dev->maxpkt;
+    else if (dev->speed == USB_SPEED_FULL)
+        per_frame = 19 * dev->maxpkt;
+    else
+        return 0;
+
+    return per_frame * frames;
+}
+
 static void
 uvc_fill_streaming_control(struct uvc_device *dev,
                            struct uvc_streaming_control *ctrl,
@@ -1439,6 +1522,7 @@ uvc_fill_streaming_control(struct uvc_device *dev,
         break;
     case V4L2_PIX_FMT_MJPEG:
     case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
         dev->width = frame->width;
         dev->height = frame->height;
         dev->imgsize = frame->width * frame->height * 2/*1.5*/;
@@ -1504,9 +1588,8 @@ uvc_events_process_control(struct uvc_device *dev, uint8_t req,
     case 1:
         switch (cs) {
             /*
-             * We support only 'UVC_CT_AE_MODE_CONTROL' for CAMERA
-             * terminal, as our bmControls[0] = 2 for CT. Also we
-             * support only auto exposure.
+             * We support 'UVC_CT_AE_MODE_CONTROL' (auto exposure
+             * only) and digital zoom/pan/tilt for CAMERA terminal.
              */
         case UVC_CT_AE_MODE_CONTROL:
             switch (req) {
@@ -1632,6 +1715,91 @@ uvc_events_process_control(struct uvc_device *dev, uint8_t req,
                 dev->request_error_code.length = 1;
             }
             break;
+        case UVC_CT_ZOOM_ABSOLUTE_CONTROL: {
+            unsigned short val;
+
+            switch (req) {
+            case UVC_SET_CUR:
+                resp->data[0] = 0x0;
+                resp->length = len;
+                break;
+            case UVC_GET_INFO:
+                resp->data[0] = 0x03;
+                resp->length = 1;
+                break;
+            case UVC_GET_MIN:
+            case UVC_GET_MAX:
+            case UVC_GET_RES:
+            case UVC_GET_DEF:
+            case UVC_GET_CUR:
+                if (req == UVC_GET_MIN)
+                    val = CT_ZOOM_MIN_VAL;
+                else if (req == UVC_GET_MAX)
+                    val = CT_ZOOM_MAX_VAL;
+                else if (req == UVC_GET_RES)
+                    val = CT_ZOOM_STEP_SIZE;
+                else if (req == UVC_GET_DEF)
+                    val = CT_ZOOM_DEFAULT_VAL;
+                else
+                    val = dev->zoom_val;
+                resp->length = 2;
+                memcpy(&resp->data[0], &val, resp->length);
+                break;
+            default:
+                resp->length = -EL2HLT;
+                dev->request_error_code.data[0] = 0x07;
+                dev->request_error_code.length = 1;
+                break;
+            }
+            if (resp->length >= 0) {
+                dev->request_error_code.data[0] = 0x00;
+                dev->request_error_code.length = 1;
+            }
+        } break;
+        case UVC_CT_PANTILT_ABSOLUTE_CONTROL: {
+            int val[2];
+
+            switch (req) {
+            case UVC_SET_CUR:
+                resp->data[0] = 0x0;
+                resp->length = len;
+                break;
+            case UVC_GET_INFO:
+                resp->data[0] = 0x03;
+                resp->length = 1;
+                break;
+            case UVC_GET_MIN:
+            case UVC_GET_MAX:
+            case UVC_GET_RES:
+            case UVC_GET_DEF:
+            case UVC_GET_CUR:
+                /* dwPanAbsolute followed by dwTiltAbsolute */
+                if (req == UVC_GET_MIN)
+                    val[0] = val[1] = CT_PANTILT_MIN_VAL;
+                else if (req == UVC_GET_MAX)
+                    val[0] = val[1] = CT_PANTILT_MAX_VAL;
+                else if (req == UVC_GET_RES)
+                    val[0] = val[1] = CT_PANTILT_STEP_SIZE;
+                else if (req == UVC_GET_DEF)
+                    val[0] = val[1] = CT_PANTILT_DEFAULT_VAL;
+                else {
+                    val[0] = dev->pan_val;
+                    val[1] = dev->tilt_val;
+                }
+                resp->length = 8;
+                memcpy(&resp->data[0], val, resp->length);
+                break;
+            default:
+                resp->length = -EL2HLT;
+                dev->request_error_code.data[0] = 0x07;
+                dev->request_error_code.length = 1;
+                break;
+            }
+            if (resp->length >= 0) {
+                dev->request_error_code.data[0] = 0x00;
+                dev->request_error_code.length = 1;
+            }
+        } break;
 
         default:
             /*
@@ -2574,7 +2742,7 @@ uvc_events_process_class(struct uvc_device *dev, struct usb_ctrlrequest *ctrl,
     if ((ctrl->bRequestType & USB_RECIP_MASK) != USB_RECIP_INTERFACE)
         return;
 
-    if ((ctrl->wIndex & 0xff) % 2 != get_uvc_streaming_intf() % 2) {
+    if ((ctrl->wIndex & 0xff) != dev->streaming_intf) {
         uvc_events_process_control(dev, ctrl->bRequest,
                                    ctrl->wValue >> 8,
                                    ctrl->wIndex >> 8,
@@ -2620,6 +2788,34 @@ uvc_events_process_control_data(struct uvc_device *dev,
     unsigned int *val = (unsigned int *)data->data;
     printf(" data = %d, length = %d  , current_cs = %d\n", *val , data->length, dev->cs);
     switch (entity_id) {
+        /* Camera terminal unit 'UVC_VC_INPUT_TERMINAL'. */
+    case 1:
+        switch (cs) {
+        case UVC_CT_ZOOM_ABSOLUTE_CONTROL:
+            if (data->length >= 2) {
+                memcpy(&dev->zoom_val, data->data, 2);
+                dev->zoom_val = clamp(dev->zoom_val,
+                                      (unsigned short)CT_ZOOM_MIN_VAL,
+                                      (unsigned short)CT_ZOOM_MAX_VAL);
+                uvc_control_set_zoom(dev->zoom_val);
+            }
+            break;
+        case UVC_CT_PANTILT_ABSOLUTE_CONTROL:
+            if (data->length >= 8) {
+                memcpy(&dev->pan_val, data->data, 4);
+                memcpy(&dev->tilt_val, data->data + 4, 4);
+                dev->pan_val = clamp(dev->pan_val, CT_PANTILT_MIN_VAL,
+                                     CT_PANTILT_MAX_VAL);
+                dev->tilt_val = clamp(dev->tilt_val, CT_PANTILT_MIN_VAL,
+                                      CT_PANTILT_MAX_VAL);
+                uvc_control_set_pantilt(dev->pan_val, dev->tilt_val);
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+
         /* Processing unit 'UVC_VC_PROCESSING_UNIT'. */
     case 2:
         switch (cs) {
@@ -2722,6 +2918,8 @@ uvc_events_process_control_data(struct uvc_device *dev,
                 memcpy(dev->ex_ctrl, data->data, data->length);
                 printf("extension control: 0x%02x 0x%02x 0x%02x\n",
                        dev->ex_ctrl[0], dev->ex_ctrl[1], dev->ex_ctrl[2]);
+                if (dev->ex_ctrl[0] == XU_CMD_REQUEST_IDR)
+                    uvc_control_request_idr(dev->video_id);
                 //if (dev->ex_ctrl[0] == 0xc5)
                 //    video_record_get_flt_parameter(dev->ex_ctrl[3], dev->ex_ctrl[4]);
             }
@@ -2809,6 +3007,7 @@ uvc_events_process_data(struct uvc_device *dev, struct uvc_request_data *data)
         break;
     case V4L2_PIX_FMT_MJPEG:
     case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
         if (dev->imgsize == 0)
             printf("WARNING: MJPEG/h.264 requested and no image loaded.\n");
         dev->width = frame->width;
@@ -2847,12 +3046,15 @@ uvc_events_process_data(struct uvc_device *dev, struct uvc_request_data *data)
             break;
         case V4L2_PIX_FMT_MJPEG:
         case V4L2_PIX_FMT_H264:
+        case V4L2_PIX_FMT_HEVC:
             fmt.fmt.pix.sizeimage = (fmt.fmt.pix.width * fmt.fmt.pix.height * 2/*1.5*/);//dev->imgsize;
             break;
         }
 
         uvc_set_user_resolution(fmt.fmt.pix.width, fmt.fmt.pix.height, dev->video_id);
         uvc_set_user_fcc(fmt.fmt.pix.pixelformat, dev->video_id);
+        uvc_set_user_link_rate(uvc_video_link_rate(dev), dev->video_id);
+        uvc_set_user_max_frame_size(target->dwMaxVideoFrameSize, dev->video_id);
         if (uvc_buffer_init(dev->video_id))
             goto err;
 
@@ -2930,25 +3132,7 @@ uvc_events_process(struct uvc_device *dev)
         return;
 
     case UVC_EVENT_STREAMOFF:
-        /* Stop V4L2 streaming... */
-        if (!dev->run_standalone && dev->vdev->is_streaming) {
-            /* UVC - V4L2 integrated path. */
-            v4l2_stop_capturing(dev->vdev);
-            dev->vdev->is_streaming = 0;
-        }
-
-        /* ... and now UVC streaming.. */
-        if (dev->is_streaming) {
-            uvc_video_stream(dev, 0);
-            uvc_uninit_device(dev);
-            uvc_video_reqbufs(dev, 0);
-            dev->is_streaming = 0;
-            dev->first_buffer_queued = 0;
-        }
-
-        uvc_buffer_deinit(dev->video_id);
-        uvc_control_exit();
-
+        uvc_handle_streamoff_event(dev);
         return;
     }
 
@@ -2972,6 +3156,7 @@ uvc_events_init(struct uvc_device *dev)
         break;
     case V4L2_PIX_FMT_MJPEG:
     case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
         payload_size = dev->imgsize;
         break;
     default:
@@ -3038,7 +3223,8 @@ static void usage(const char *argv0)
     fprintf(stderr, " -f <format>    Select frame format\n\t"
             "0 = V4L2_PIX_FMT_YUYV\n\t"
             "1 = V4L2_PIX_FMT_MJPEG\n\t"
-            "2 = V4L2_PIX_FMT_H264\n");
+            "2 = V4L2_PIX_FMT_H264\n\t"
+            "3 = V4L2_PIX_FMT_HEVC\n");
     fprintf(stderr, " -h		Print this help screen and exit\n");
     fprintf(stderr, " -i image	MJPEG image\n");
     fprintf(stderr, " -m		Streaming mult for ISOC (b/w 0 and 2)\n");
@@ -3211,6 +3397,10 @@ uvc_gadget_main(int id)
             fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
             break;
 
+        case 3:
+            fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_HEVC;
+            break;
+
         case 0:
         default:
             fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
@@ -3231,6 +3421,7 @@ uvc_gadget_main(int id)
 
     udev->uvc_devname = uvc_devname;
     udev->video_id = id;
+    udev->streaming_intf = get_uvc_streaming_intf(id);
 
     if (!dummy_data_gen_mode && !mjpeg_image) {
         vdev->v4l2_devname = v4l2_devname;
@@ -3254,6 +3445,10 @@ uvc_gadget_main(int id)
         udev->fcc = V4L2_PIX_FMT_H264;
         break;
 
+    case 3:
+        udev->fcc = V4L2_PIX_FMT_HEVC;
+        break;
+
     case 0:
     default:
         udev->fcc = V4L2_PIX_FMT_YUYV;
@@ -101,6 +101,8 @@ struct buffer {
 /* Represents a UVC based video output device */
 struct uvc_device {
     int video_id;
+    /* interface number of the function's VideoStreaming interface */
+    int streaming_intf;
     /* uvc device specific */
     int uvc_fd;
     int is_streaming;
@@ -122,6 +124,9 @@ struct uvc_device {
     unsigned int gain_val;
     unsigned int hue_auto_val;
     unsigned char power_line_frequency_val;
+    unsigned short zoom_val;
+    int pan_val;
+    int tilt_val;
     unsigned char extension_io_data[32];
     unsigned char ex_ctrl[16];//byte:1 command, 2-3 data length, 4-16 no use
     unsigned char ex_data[MAX_UVC_REQUEST_DATA_LENGTH];
@@ -35,27 +35,76 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
 #include <pthread.h>
 #include "uvc_control.h"
 #include "uvc_encode.h"
 #include "uvc_video.h"
+#include "uvc_meta.h"
+#include "uvc_frame.h"
 #include "uevent.h"
 
 #define SYS_ISP_NAME "isp"
 #define SYS_CIF_NAME "cif"
-#define UVC_STREAMING_INTF_PATH "/sys/kernel/config/usb_gadget/rockchip/functions/uvc.gs6/streaming/bInterfaceNumber"
+#define UVC_GADGET_PATH "/sys/kernel/config/usb_gadget"
+#define UVC_V4L2_PATH "/sys/class/video4linux"
+#define UVC_UDC_PATH "/sys/class/udc"
 
+/* a uvc gadget video node and the interfaces of its function */
 struct uvc_ctrl {
     int id;
-    int width;
-    int height;
-    int fps;
+    int control_intf;
+    int streaming_intf;
 };
 
-static struct uvc_ctrl uvc_ctrl[2];
-struct uvc_encode uvc_enc;
+/* a uvc function between STREAMON and STREAMOFF, with its own encoder */
+struct uvc_stream {
+    int video_id;
+    struct uvc_encode enc;
+    /* guards enc, the worker holds it for every frame */
+    pthread_mutex_t lock;
+
+    /* encodes the frames queued by uvc_submit_frame */
+    pthread_t submit_id;
+    bool submit_started;
+    bool submit_run;
+    pthread_mutex_t submit_lock;
+    pthread_cond_t submit_cond;
+    /* one frame encoding, one waiting, see uvc_submit_frame */
+    struct uvc_frame *submit_pending;
+    struct uvc_frame *submit_busy;
+    /*
+     * streams (or whoever unlinked it), every uvc_stream_set listing it
+     * and uvc_submit_flush hold one. Guarded by submit_lock, a put that
+     * leaves one broadcasts submit_cond, see uvc_stream_wait_idle.
+     */
+    int refs;
+
+    struct uvc_stream *next;
+};
+
+/* rewritten by check_uvc_video_id under lock */
+static struct uvc_ctrl *uvc_ctrl = NULL;
+static int uvc_ctrl_count = 0;
+/* guards streams and the settings below, taken before uvc_stream.lock */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static int uvc_streaming_intf = -1;
+static struct uvc_stream *streams = NULL;
+
+/*
+ * The frame paths walk a refcounted copy of streams instead of taking
+ * lock. A copy is replaced under lock; the last put of the old one frees
+ * it and drops its stream references.
+ */
+struct uvc_stream_set {
+    int refs;
+    int count;
+    struct uvc_stream *s[];
+};
+/* only held to load stream_set and take a reference on it */
+static pthread_mutex_t stream_set_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct uvc_stream_set *stream_set = NULL;
 
 static pthread_t run_id = 0;
 static bool run_flag = true;
@@ -65,6 +114,30 @@ static pthread_cond_t video_added = PTHREAD_COND_INITIALIZER;
 
 static uvc_open_camera_callback uvc_open_camera_cb = NULL;
 static uvc_close_camera_callback uvc_close_camera_cb = NULL;
+static uvc_meta_sink_callback uvc_meta_sink_cb = NULL;
+
+static int capture_width = 0;
+static int capture_height = 0;
+/*
+ * Held across deciding to open or close the camera and the callback that
+ * does it, so a close never overtakes a later open. Taken before lock,
+ * camera_opened is written with both held.
+ */
+static pthread_mutex_t camera_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool camera_opened = false;
+/* size the camera was opened at, later streams scale from it */
+static int camera_width = 0;
+static int camera_height = 0;
+
+static bool async_encode = false;
+static bool adaptive_quant = true;
+static int slice_bytes = 0;
+static size_t frame_size_cap = 0;
+static int stream_fps = 30;
+
+static int roi_zoom = UVC_ZOOM_MIN;
+static int roi_pan = 0;
+static int roi_tilt = 0;
 
 void register_uvc_open_camera(uvc_open_camera_callback cb)
 {
@@ -76,6 +149,192 @@ void register_uvc_close_camera(uvc_close_camera_callback cb)
     uvc_close_camera_cb = cb;
 }
 
+void register_uvc_meta_sink(uvc_meta_sink_callback cb)
+{
+    uvc_meta_sink_cb = cb;
+}
+
+void uvc_control_fixed_capture(int width, int height)
+{
+    capture_width = width;
+    capture_height = height;
+}
+
+static bool uvc_control_is_fixed_capture(void)
+{
+    return capture_width > 0 && capture_height > 0;
+}
+
+/* called with camera_lock held */
+static void uvc_control_close_camera(void)
+{
+    if (!camera_opened)
+        return;
+    pthread_mutex_lock(&lock);
+    camera_opened = false;
+    pthread_mutex_unlock(&lock);
+    if (uvc_close_camera_cb)
+        uvc_close_camera_cb();
+}
+
+/* called with lock and s->lock held */
+static void uvc_control_apply_roi(struct uvc_stream *s)
+{
+    if (uvc_encode_set_roi(&s->enc, roi_zoom, roi_pan, roi_tilt))
+        printf("%s: video%d zoom %d pan %d tilt %d fail!\n", __func__,
+               s->video_id, roi_zoom, roi_pan, roi_tilt);
+}
+
+void uvc_control_async_encode(bool enable)
+{
+    async_encode = enable;
+}
+
+void uvc_control_slice_encode(int bytes)
+{
+    slice_bytes = bytes > 0 ? bytes : 0;
+}
+
+void uvc_control_low_latency(bool enable, bool baseline)
+{
+    RK_U32 flags = 0;
+
+    if (enable)
+        flags |= MPI_ENC_LOW_LATENCY;
+    if (enable && baseline)
+        flags |= MPI_ENC_LOW_LATENCY_BASELINE;
+    mpi_enc_set_low_latency(flags);
+}
+
+void uvc_control_adaptive_quant(bool enable)
+{
+    struct uvc_stream *s;
+
+    pthread_mutex_lock(&lock);
+    adaptive_quant = enable;
+    for (s = streams; s; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        uvc_encode_set_adaptive_quant(&s->enc, enable);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void uvc_control_frame_size_cap(size_t bytes)
+{
+    struct uvc_stream *s;
+
+    pthread_mutex_lock(&lock);
+    frame_size_cap = bytes;
+    for (s = streams; s; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        uvc_encode_set_size_cap(&s->enc, bytes);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int uvc_control_prewarm(int width, int height, int fcc)
+{
+    if (uvc_encode_prewarm(width, height, fcc)) {
+        printf("%s: %dx%d fcc %d fail!\n", __func__, width, height, fcc);
+        return -1;
+    }
+    return 0;
+}
+
+void uvc_control_set_fps(int fps)
+{
+    MpiEncRcParam param;
+
+    if (fps <= 0)
+        return;
+    memset(&param, 0, sizeof(param));
+    param.change = MPI_ENC_RC_CHANGE_FPS;
+    param.fps = fps;
+    pthread_mutex_lock(&lock);
+    stream_fps = fps;
+    pthread_mutex_unlock(&lock);
+    uvc_control_set_rc(&param);
+}
+
+int uvc_control_set_rc(const struct MpiEncRcParam *param)
+{
+    struct uvc_stream *s;
+    int ret;
+
+    pthread_mutex_lock(&lock);
+    ret = streams ? 0 : -1;
+    for (s = streams; s; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        if (uvc_encode_set_rc(&s->enc, param))
+            ret = -1;
+        pthread_mutex_unlock(&s->lock);
+    }
+    if (!ret && (param->change & MPI_ENC_RC_CHANGE_FPS))
+        stream_fps = param->fps;
+    pthread_mutex_unlock(&lock);
+
+    return ret;
+}
+
+int uvc_control_encode_backend(const char *name)
+{
+    if (!strcmp(name, "mpp"))
+        return uvc_encode_set_backend(UVC_ENCODE_MPP);
+    if (!strcmp(name, "cpu"))
+        return uvc_encode_set_backend(UVC_ENCODE_CPU);
+    if (!strcmp(name, "auto"))
+        return uvc_encode_set_backend(UVC_ENCODE_AUTO);
+    printf("%s: unknown encoder %s\n", __func__, name);
+
+    return -1;
+}
+
+void uvc_control_request_idr(int video_id)
+{
+    struct uvc_stream *s;
+
+    pthread_mutex_lock(&lock);
+    for (s = streams; s; s = s->next) {
+        if (video_id >= 0 && s->video_id != video_id)
+            continue;
+        pthread_mutex_lock(&s->lock);
+        uvc_encode_request_idr(&s->enc);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* called with lock held */
+static void uvc_control_apply_roi_all(void)
+{
+    struct uvc_stream *s;
+
+    for (s = streams; s; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        uvc_control_apply_roi(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void uvc_control_set_zoom(int zoom)
+{
+    pthread_mutex_lock(&lock);
+    roi_zoom = zoom;
+    uvc_control_apply_roi_all();
+    pthread_mutex_unlock(&lock);
+}
+
+void uvc_control_set_pantilt(int pan, int tilt)
+{
+    pthread_mutex_lock(&lock);
+    roi_pan = pan;
+    roi_tilt = tilt;
+    uvc_control_apply_roi_all();
+    pthread_mutex_unlock(&lock);
+}
+
 static bool is_uvc_video(void *buf)
 {
     if (strstr(buf, "usb") || strstr(buf, "gadget"))
@@ -84,108 +343,654 @@ static bool is_uvc_video(void *buf)
         return false;
 }
 
-static void query_uvc_streaming_intf(void)
+static int read_sys_int(const char *path)
 {
-    int fd;
+    char buf[32] = {0};
+    int fd, ret = -1;
 
-    fd = open(UVC_STREAMING_INTF_PATH, O_RDONLY);
-    if (fd >= 0) {
-        char intf[32] = {0};
-        read(fd, intf, sizeof(intf) - 1);
-        uvc_streaming_intf = atoi(intf);
-        printf("uvc_streaming_intf = %d\n", uvc_streaming_intf);
-        close(fd);
-    } else {
-        printf("open %s failed!\n", UVC_STREAMING_INTF_PATH);
-    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (read(fd, buf, sizeof(buf) - 1) > 0)
+        ret = atoi(buf);
+    close(fd);
+
+    return ret;
 }
 
-int get_uvc_streaming_intf(void)
+/* UDC a gadget is bound to, false when it is not bound */
+static bool read_gadget_udc(const char *gadget, char *udc, size_t size)
 {
-    return uvc_streaming_intf;
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s/UDC", UVC_GADGET_PATH, gadget);
+    fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    if (!fgets(udc, size, fp))
+        udc[0] = 0;
+    fclose(fp);
+    udc[strcspn(udc, "\n")] = 0;
+
+    return udc[0];
 }
 
-int check_uvc_video_id(void)
+/* a uvc.* function of a bound gadget, see query_uvc_functions */
+struct uvc_function {
+    char udc[64];
+    int control_intf;
+    int streaming_intf;
+};
+
+static int cmp_function(const void *a, const void *b)
+{
+    const struct uvc_function *fa = (const struct uvc_function *)a;
+    const struct uvc_function *fb = (const struct uvc_function *)b;
+    int ret = strcmp(fa->udc, fb->udc);
+
+    return ret ? ret : fa->control_intf - fb->control_intf;
+}
+
+static int cmp_int(const void *a, const void *b)
 {
-    FILE *fp = NULL;
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Interfaces of every uvc.* function of the bound gadgets, sorted by UDC
+ * and then by interface. Interface numbers restart with every gadget;
+ * within one gadget they are taken in the order the functions bind.
+ */
+static int query_uvc_functions(struct uvc_function **funcs)
+{
+    char path[PATH_MAX];
+    char udc[64];
+    struct uvc_function *c, *list = NULL;
+    struct dirent *g, *f;
+    DIR *gdir, *fdir;
+    int count = 0;
+
+    gdir = opendir(UVC_GADGET_PATH);
+    if (!gdir) {
+        printf("open %s failed!\n", UVC_GADGET_PATH);
+        return 0;
+    }
+    while ((g = readdir(gdir))) {
+        if (g->d_name[0] == '.' || !read_gadget_udc(g->d_name, udc, sizeof(udc)))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/functions", UVC_GADGET_PATH,
+                 g->d_name);
+        fdir = opendir(path);
+        if (!fdir)
+            continue;
+        while ((f = readdir(fdir))) {
+            if (strncmp(f->d_name, "uvc.", 4))
+                continue;
+            c = (struct uvc_function *)realloc(list, (count + 1) * sizeof(*list));
+            if (!c)
+                break;
+            list = c;
+            c = &list[count];
+            snprintf(c->udc, sizeof(c->udc), "%s", udc);
+            snprintf(path, sizeof(path), "%s/%s/functions/%s/control/bInterfaceNumber",
+                     UVC_GADGET_PATH, g->d_name, f->d_name);
+            c->control_intf = read_sys_int(path);
+            snprintf(path, sizeof(path), "%s/%s/functions/%s/streaming/bInterfaceNumber",
+                     UVC_GADGET_PATH, g->d_name, f->d_name);
+            c->streaming_intf = read_sys_int(path);
+            /* not linked into a config */
+            if (c->control_intf < 0 || c->streaming_intf < 0)
+                continue;
+            printf("%s/%s on %s: control intf %d, streaming intf %d\n",
+                   g->d_name, f->d_name, udc, c->control_intf, c->streaming_intf);
+            count++;
+        }
+        closedir(fdir);
+    }
+    closedir(gdir);
+    if (count > 1)
+        qsort(list, count, sizeof(*list), cmp_function);
+    *funcs = list;
+
+    return count;
+}
+
+static int query_uvc_video_ids(int **ids)
+{
+    char path[PATH_MAX];
     char buf[1024];
-    int i;
-    char cmd[128];
-
-    memset(&uvc_ctrl, 0, sizeof(uvc_ctrl));
-    uvc_ctrl[0].id = -1;
-    uvc_ctrl[1].id = -1;
-    for (i = 0; i < 30; i++) {
-        snprintf(cmd, sizeof(cmd), "/sys/class/video4linux/video%d/name", i);
-        if (access(cmd, F_OK))
+    struct dirent *d;
+    int *c, *list = NULL;
+    int count = 0, id;
+    FILE *fp;
+    DIR *dir;
+
+    dir = opendir(UVC_V4L2_PATH);
+    if (!dir)
+        return 0;
+    while ((d = readdir(dir))) {
+        if (sscanf(d->d_name, "video%d", &id) != 1)
             continue;
-        snprintf(cmd, sizeof(cmd), "cat /sys/class/video4linux/video%d/name", i);
-        fp = popen(cmd, "r");
-        if (fp) {
-            if (fgets(buf, sizeof(buf), fp)) {
-                if (is_uvc_video(buf)) {
-                    if (uvc_ctrl[0].id < 0)
-                        uvc_ctrl[0].id = i;
-                    else if (uvc_ctrl[1].id < 0)
-                        uvc_ctrl[1].id = i;
-                }
+        snprintf(path, sizeof(path), "%s/%s/name", UVC_V4L2_PATH, d->d_name);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (fgets(buf, sizeof(buf), fp) && is_uvc_video(buf)) {
+            c = (int *)realloc(list, (count + 1) * sizeof(*list));
+            if (c) {
+                list = c;
+                list[count++] = id;
             }
-            pclose(fp);
+        }
+        fclose(fp);
+    }
+    closedir(dir);
+    if (count > 1)
+        qsort(list, count, sizeof(*list), cmp_int);
+    *ids = list;
+
+    return count;
+}
+
+int get_uvc_streaming_intf(int video_id)
+{
+    int i, intf = -1;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < uvc_ctrl_count; i++) {
+        if (uvc_ctrl[i].id == video_id) {
+            intf = uvc_ctrl[i].streaming_intf;
+            break;
         }
     }
-    if (uvc_ctrl[0].id < 0 && uvc_ctrl[1].id < 0) {
+    pthread_mutex_unlock(&lock);
+
+    return intf;
+}
+
+/*
+ * Whether videoN hangs below the controller of udc. f_uvc registers its
+ * node on the gadget device, a child of the same controller.
+ */
+static bool is_video_on_udc(int id, const char *udc)
+{
+    char path[PATH_MAX];
+    char dev[PATH_MAX], node[PATH_MAX];
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s/%s/device", UVC_UDC_PATH, udc);
+    if (!realpath(path, dev))
+        return false;
+    snprintf(path, sizeof(path), "%s/video%d", UVC_V4L2_PATH, id);
+    if (!realpath(path, node))
+        return false;
+    len = strlen(dev);
+
+    return !strncmp(node, dev, len) && node[len] == '/';
+}
+
+int check_uvc_video_id(void)
+{
+    struct uvc_function *funcs = NULL;
+    struct uvc_ctrl *ctrl;
+    int *ids = NULL;
+    int count, nids, i, j, k, n;
+
+    nids = query_uvc_video_ids(&ids);
+    if (nids <= 0) {
         printf("Please configure uvc...\n");
+        free(ids);
+        return -1;
+    }
+    ctrl = (struct uvc_ctrl *)calloc(nids, sizeof(*ctrl));
+    if (!ctrl) {
+        free(ids);
         return -1;
     }
-    query_uvc_streaming_intf();
+    for (i = 0; i < nids; i++) {
+        ctrl[i].id = ids[i];
+        ctrl[i].control_intf = -1;
+        ctrl[i].streaming_intf = -1;
+    }
+    /*
+     * The functions of one gadget bind one after the other, each taking
+     * its interfaces and then registering its node, so the n-th function
+     * of a UDC owns the n-th lowest node below that UDC.
+     */
+    count = query_uvc_functions(&funcs);
+    for (j = 0; j < count; j = k) {
+        for (k = j; k < count && !strcmp(funcs[k].udc, funcs[j].udc); k++)
+            ;
+        for (i = 0, n = j; i < nids && n < k; i++) {
+            if (!is_video_on_udc(ids[i], funcs[j].udc))
+                continue;
+            ctrl[i].control_intf = funcs[n].control_intf;
+            ctrl[i].streaming_intf = funcs[n].streaming_intf;
+            n++;
+        }
+        if (n < k)
+            printf("%s: %d uvc functions on %s without a video node\n",
+                   __func__, k - n, funcs[j].udc);
+    }
+    for (i = 0; i < nids; i++)
+        printf("video%d: streaming intf %d\n", ctrl[i].id,
+               ctrl[i].streaming_intf);
+    free(funcs);
+    free(ids);
+
+    pthread_mutex_lock(&lock);
+    free(uvc_ctrl);
+    uvc_ctrl = ctrl;
+    uvc_ctrl_count = nids;
+    pthread_mutex_unlock(&lock);
+
     return 0;
 }
 
+/* uvc_ctrl is only rewritten from this same thread */
 void add_uvc_video()
 {
-    if (uvc_ctrl[0].id >= 0)
-        uvc_video_id_add(uvc_ctrl[0].id);
-    if (uvc_ctrl[1].id >= 0)
-        uvc_video_id_add(uvc_ctrl[1].id);
+    int i;
+
+    for (i = 0; i < uvc_ctrl_count; i++)
+        uvc_video_id_add(uvc_ctrl[i].id);
+}
+
+void uvc_read_camera_buffer(void *cam_buf, int cam_fd, size_t cam_size,
+                            void* extra_data, size_t extra_size)
+{
+    uvc_read_camera_buffer_roi(cam_buf, cam_fd, cam_size, extra_data, extra_size,
+                               NULL, -1);
 }
 
-void uvc_control_init(int width, int height, int fcc)
+/* count < 0 keeps the regions of the previous frame */
+void uvc_read_camera_buffer_roi(void *cam_buf, int cam_fd, size_t cam_size,
+                                void* extra_data, size_t extra_size,
+                                const struct MpiEncRoiRegion *roi, int count)
 {
-    pthread_mutex_lock(&lock);
-    memset(&uvc_enc, 0, sizeof(uvc_enc));
-    if (uvc_encode_init(&uvc_enc, width, height, fcc)) {
-        printf("%s fail!\n", __func__);
+    struct uvc_meta meta;
+
+    meta.type = UVC_META_RAW;
+    meta.data = extra_data;
+    meta.size = extra_size;
+    uvc_read_camera_buffer_meta(cam_buf, cam_fd, cam_size, &meta,
+                                extra_data ? 1 : 0, roi, count);
+}
+
+static void uvc_stream_process(struct uvc_stream *s, void *cam_buf,
+                               int cam_fd, size_t cam_size,
+                               const struct uvc_meta *meta, int meta_count,
+                               const struct MpiEncRoiRegion *roi, int count,
+                               struct uvc_frame *frame)
+{
+    struct uvc_encode *e = &s->enc;
+    bool done;
+
+    pthread_mutex_lock(&s->lock);
+    if (cam_size <= e->src.width * e->src.height * 2) {
+        if (count >= 0)
+            uvc_encode_set_roi_regions(e, roi, count);
+        uvc_encode_set_meta(e, meta, meta_count);
+        if (frame)
+            done = uvc_encode_process_frame(e, frame);
+        else
+            done = uvc_encode_process(e, cam_buf, cam_fd, cam_size);
+        if (done && uvc_meta_sink_cb && meta_count > 0)
+            uvc_meta_sink_cb(e->fcc, meta, meta_count);
+    } else {
+        printf("%s: video%d cam_size = %u, src.width = %d, src.height = %d\n",
+               __func__, s->video_id, cam_size, e->src.width, e->src.height);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void uvc_stream_get(struct uvc_stream *s)
+{
+    pthread_mutex_lock(&s->submit_lock);
+    s->refs++;
+    pthread_mutex_unlock(&s->submit_lock);
+}
+
+static void uvc_stream_put(struct uvc_stream *s)
+{
+    pthread_mutex_lock(&s->submit_lock);
+    if (--s->refs == 1)
+        pthread_cond_broadcast(&s->submit_cond);
+    pthread_mutex_unlock(&s->submit_lock);
+}
+
+/* Block until the caller, which unlinked s, holds its only reference. */
+static void uvc_stream_wait_idle(struct uvc_stream *s)
+{
+    pthread_mutex_lock(&s->submit_lock);
+    while (s->refs > 1)
+        pthread_cond_wait(&s->submit_cond, &s->submit_lock);
+    pthread_mutex_unlock(&s->submit_lock);
+}
+
+static struct uvc_stream_set *uvc_stream_set_get(void)
+{
+    struct uvc_stream_set *set;
+
+    pthread_mutex_lock(&stream_set_lock);
+    set = stream_set;
+    if (set)
+        __atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&stream_set_lock);
+
+    return set;
+}
+
+static void uvc_stream_set_put(struct uvc_stream_set *set)
+{
+    int i;
+
+    if (!set || __atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    for (i = 0; i < set->count; i++)
+        uvc_stream_put(set->s[i]);
+    free(set);
+}
+
+/* Copy streams for the frame paths, with lock held. */
+static void uvc_stream_set_publish(void)
+{
+    struct uvc_stream_set *set, *old;
+    struct uvc_stream *s;
+    int n = 0;
+
+    for (s = streams; s; s = s->next)
+        n++;
+    set = (struct uvc_stream_set *)malloc(sizeof(*set) + n * sizeof(set->s[0]));
+    if (!set) {
+        printf("%s: malloc fail!\n", __func__);
         abort();
     }
-    pthread_mutex_unlock(&lock);
-    if (uvc_open_camera_cb)
-        uvc_open_camera_cb(width, height);
+    set->refs = 1;
+    set->count = 0;
+    for (s = streams; s; s = s->next) {
+        uvc_stream_get(s);
+        set->s[set->count++] = s;
+    }
+
+    pthread_mutex_lock(&stream_set_lock);
+    old = stream_set;
+    stream_set = set;
+    pthread_mutex_unlock(&stream_set_lock);
+    uvc_stream_set_put(old);
 }
 
-void uvc_control_exit()
+/*
+ * The same camera frame is encoded by every stream in turn. Only the
+ * stream being encoded is locked, so other callers and the submit
+ * workers encode on the other streams meanwhile.
+ */
+static void uvc_control_process(void *cam_buf, int cam_fd, size_t cam_size,
+                                const struct uvc_meta *meta, int meta_count,
+                                const struct MpiEncRoiRegion *roi, int count,
+                                struct uvc_frame *frame)
 {
-    if (uvc_close_camera_cb)
-        uvc_close_camera_cb();
+    struct uvc_stream_set *set;
+    int i;
+
+    if (meta_count > UVC_META_MAX)
+        meta_count = UVC_META_MAX;
+    set = uvc_stream_set_get();
+    for (i = 0; set && i < set->count; i++)
+        uvc_stream_process(set->s[i], cam_buf, cam_fd, cam_size, meta,
+                           meta_count, roi, count, frame);
+    uvc_stream_set_put(set);
+}
+
+static void *uvc_submit_thread(void *arg)
+{
+    struct uvc_stream *s = (struct uvc_stream *)arg;
+    struct uvc_frame *frame;
+    int meta_count;
+
+    pthread_mutex_lock(&s->submit_lock);
+    while (1) {
+        while (s->submit_run && !s->submit_pending)
+            pthread_cond_wait(&s->submit_cond, &s->submit_lock);
+        if (!s->submit_pending)
+            break;
+        frame = s->submit_pending;
+        s->submit_pending = NULL;
+        s->submit_busy = frame;
+        pthread_mutex_unlock(&s->submit_lock);
+
+        meta_count = frame->meta_count;
+        if (meta_count > UVC_META_MAX)
+            meta_count = UVC_META_MAX;
+        uvc_stream_process(s, frame->virt, frame->fd, frame->size,
+                           frame->meta, meta_count, NULL, -1, frame);
+        uvc_frame_put(frame);
+
+        pthread_mutex_lock(&s->submit_lock);
+        s->submit_busy = NULL;
+        pthread_cond_broadcast(&s->submit_cond);
+    }
+    pthread_mutex_unlock(&s->submit_lock);
+
+    return NULL;
+}
+
+static int uvc_submit_start(struct uvc_stream *s)
+{
+    s->submit_run = true;
+    if (pthread_create(&s->submit_id, NULL, uvc_submit_thread, s)) {
+        printf("%s: pthread_create failed!\n", __func__);
+        s->submit_run = false;
+        return -1;
+    }
+    s->submit_started = true;
+
+    return 0;
+}
+
+static void uvc_submit_stop(struct uvc_stream *s)
+{
+    if (!s->submit_started)
+        return;
+    pthread_mutex_lock(&s->submit_lock);
+    s->submit_run = false;
+    pthread_cond_broadcast(&s->submit_cond);
+    pthread_mutex_unlock(&s->submit_lock);
+    /* encodes what is still queued on the way out */
+    pthread_join(s->submit_id, NULL);
+    s->submit_started = false;
+}
+
+int uvc_submit_frame(struct uvc_frame *frame)
+{
+    struct uvc_stream_set *set;
+    struct uvc_stream *s;
+    struct uvc_frame *drop;
+    int i, ret = -1;
+
+    /* per frame, so no lock: only the queue of each stream is locked */
+    set = uvc_stream_set_get();
+    for (i = 0; set && i < set->count; i++) {
+        s = set->s[i];
+        if (!s->submit_started)
+            continue;
+        pthread_mutex_lock(&s->submit_lock);
+        /* not started yet and stale now, the newer frame takes its place */
+        drop = s->submit_pending;
+        s->submit_pending = uvc_frame_get(frame);
+        pthread_cond_broadcast(&s->submit_cond);
+        pthread_mutex_unlock(&s->submit_lock);
+        if (drop)
+            uvc_frame_put(drop);
+        ret = 0;
+    }
+    uvc_stream_set_put(set);
+
+    return ret;
+}
+
+void uvc_submit_flush(void)
+{
+    struct uvc_stream_set *set = uvc_stream_set_get();
+    struct uvc_stream **list;
+    struct uvc_stream *s;
+    int i, count;
+
+    /* hold the streams, not the set, while waiting for the workers */
+    count = set ? set->count : 0;
+    list = count ? (struct uvc_stream **)malloc(count * sizeof(*list)) : NULL;
+    if (!list) {
+        uvc_stream_set_put(set);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        list[i] = set->s[i];
+        uvc_stream_get(list[i]);
+    }
+    uvc_stream_set_put(set);
+
+    for (i = 0; i < count; i++) {
+        s = list[i];
+        pthread_mutex_lock(&s->submit_lock);
+        while (s->submit_pending || s->submit_busy)
+            pthread_cond_wait(&s->submit_cond, &s->submit_lock);
+        pthread_mutex_unlock(&s->submit_lock);
+        uvc_stream_put(s);
+    }
+    free(list);
+}
+
+static void uvc_stream_destroy(struct uvc_stream *s)
+{
+    uvc_submit_stop(s);
+    /* a frame submitted after the worker drained is dropped */
+    if (s->submit_pending)
+        uvc_frame_put(s->submit_pending);
+    pthread_mutex_lock(&s->lock);
+    uvc_encode_exit(&s->enc);
+    pthread_mutex_unlock(&s->lock);
+    pthread_cond_destroy(&s->submit_cond);
+    pthread_mutex_destroy(&s->submit_lock);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int uvc_control_init(int video_id, int width, int height, int fcc, int fps)
+{
+    bool fixed = uvc_control_is_fixed_capture();
+    struct uvc_stream *s;
+    int cap_width = 0, cap_height = 0;
+    bool open = false;
+
+    s = (struct uvc_stream *)calloc(1, sizeof(*s));
+    if (!s) {
+        printf("%s: video%d calloc fail!\n", __func__, video_id);
+        return -1;
+    }
+    s->video_id = video_id;
+    s->refs = 1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->submit_lock, NULL);
+    pthread_cond_init(&s->submit_cond, NULL);
+
     pthread_mutex_lock(&lock);
-    uvc_encode_exit(&uvc_enc);
-    memset(&uvc_enc, 0, sizeof(uvc_enc));
+    if (fps <= 0)
+        fps = stream_fps;
+    pthread_mutex_unlock(&lock);
+    /* may wait for the vpu, other streams keep going meanwhile */
+    if (uvc_encode_init(&s->enc, width, height, fcc, fps)) {
+        printf("%s: video%d fail!\n", __func__, video_id);
+        uvc_stream_destroy(s);
+        return -1;
+    }
+    s->enc.video_id = video_id;
+
+    pthread_mutex_lock(&camera_lock);
+    pthread_mutex_lock(&lock);
+    if (fixed) {
+        cap_width = capture_width;
+        cap_height = capture_height;
+    } else if (camera_opened &&
+               (camera_width != width || camera_height != height)) {
+        /* another stream already runs the camera, scale from its size */
+        cap_width = camera_width;
+        cap_height = camera_height;
+    }
+    if (cap_width && uvc_encode_set_capture(&s->enc, cap_width, cap_height)) {
+        printf("%s: video%d set capture %dx%d fail!\n", __func__,
+               video_id, cap_width, cap_height);
+        pthread_mutex_unlock(&lock);
+        pthread_mutex_unlock(&camera_lock);
+        /* the streams of the other functions keep running */
+        uvc_stream_destroy(s);
+        return -1;
+    }
+    if (slice_bytes && uvc_encode_set_slice(&s->enc, slice_bytes))
+        printf("%s: slice encode fail, encode whole frames\n", __func__);
+    if (async_encode && uvc_encode_set_async(&s->enc))
+        printf("%s: async encode fail, use sync encode\n", __func__);
+    uvc_encode_set_adaptive_quant(&s->enc, adaptive_quant);
+    uvc_encode_set_size_cap(&s->enc, frame_size_cap);
+    uvc_control_apply_roi(s);
+    if (uvc_submit_start(s))
+        printf("%s: video%d takes no submitted frames\n", __func__, video_id);
+    s->next = streams;
+    streams = s;
+    uvc_stream_set_publish();
+    if (!camera_opened) {
+        camera_width = fixed ? capture_width : width;
+        camera_height = fixed ? capture_height : height;
+        camera_opened = true;
+        open = true;
+    }
     pthread_mutex_unlock(&lock);
+    if (open && uvc_open_camera_cb)
+        uvc_open_camera_cb(camera_width, camera_height);
+    pthread_mutex_unlock(&camera_lock);
+
+    return 0;
 }
 
-void uvc_read_camera_buffer(void *cam_buf, int cam_fd, size_t cam_size,
-                            void* extra_data, size_t extra_size)
+void uvc_control_exit(int video_id)
 {
+    struct uvc_stream *s, **p;
+    bool last;
+
+    pthread_mutex_lock(&camera_lock);
     pthread_mutex_lock(&lock);
-    if (cam_size <= uvc_enc.width * uvc_enc.height * 2) {
-        uvc_enc.video_id = uvc_video_id_get(0);
-        uvc_enc.extra_data = extra_data;
-        uvc_enc.extra_size = extra_size;
-        uvc_encode_process(&uvc_enc, cam_buf, cam_fd, cam_size);
-    } else if (uvc_enc.width > 0 && uvc_enc.height > 0) {
-        printf("%s: cam_size = %u, uvc_enc.width = %d, uvc_enc.height = %d\n",
-               __func__, cam_size, uvc_enc.width, uvc_enc.height);
+    for (p = &streams; *p && (*p)->video_id != video_id; p = &(*p)->next)
+        ;
+    s = *p;
+    if (s) {
+        *p = s->next;
+        uvc_stream_set_publish();
     }
+    last = !streams;
     pthread_mutex_unlock(&lock);
+    /* In fixed capture mode the camera keeps running between streams. */
+    if (last && !uvc_control_is_fixed_capture())
+        uvc_control_close_camera();
+    pthread_mutex_unlock(&camera_lock);
+    if (s) {
+        /* frame paths that still got s finish their frame on it first */
+        uvc_stream_wait_idle(s);
+        uvc_stream_destroy(s);
+    }
+}
+
+void uvc_read_camera_buffer_meta(void *cam_buf, int cam_fd, size_t cam_size,
+                                 const struct uvc_meta *meta, int meta_count,
+                                 const struct MpiEncRoiRegion *roi, int count)
+{
+    uvc_control_process(cam_buf, cam_fd, cam_size, meta, meta_count,
+                        roi, count, NULL);
+}
+
+void uvc_read_camera_frame(struct uvc_frame *frame)
+{
+    uvc_control_process(frame->virt, frame->fd, frame->size, frame->meta,
+                        frame->meta_count, NULL, -1, frame);
 }
 
 static void uvc_control_wait(void)
@@ -260,6 +1065,8 @@ int uvc_control_run(uint32_t flags)
 
 void uvc_control_join(uint32_t flags)
 {
+    struct uvc_stream_set *old;
+
     if (flags & UVC_CONTROL_CHECK_STRAIGHT) {
         uvc_video_id_exit_all();
     } else {
@@ -269,4 +1076,28 @@ void uvc_control_join(uint32_t flags)
         if (flags & UVC_CONTROL_LOOP_ONCE);
             uvc_video_id_exit_all();
     }
+    pthread_mutex_lock(&camera_lock);
+    uvc_control_close_camera();
+    pthread_mutex_unlock(&camera_lock);
+    pthread_mutex_lock(&lock);
+    while (streams) {
+        struct uvc_stream *s = streams;
+
+        streams = s->next;
+        uvc_stream_set_publish();
+        pthread_mutex_unlock(&lock);
+        uvc_stream_wait_idle(s);
+        uvc_stream_destroy(s);
+        pthread_mutex_lock(&lock);
+    }
+    free(uvc_ctrl);
+    uvc_ctrl = NULL;
+    uvc_ctrl_count = 0;
+    pthread_mutex_lock(&stream_set_lock);
+    old = stream_set;
+    stream_set = NULL;
+    pthread_mutex_unlock(&stream_set_lock);
+    pthread_mutex_unlock(&lock);
+    uvc_stream_set_put(old);
+    mpi_enc_pool_clear();
 }
@@ -39,6 +39,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifdef USE_RK_MODULE
 #define ISP_SEQ 1
@@ -55,18 +56,177 @@ extern "C" {
 #define UVC_CONTROL_LOOP_ONCE		(1 << 0)
 #define UVC_CONTROL_CHECK_STRAIGHT	(1 << 1)
 
+/* Digital zoom in 1/100 steps, pan/tilt in arc seconds (UVC CT units). */
+#define UVC_ZOOM_MIN		100
+#define UVC_ZOOM_MAX		400
+#define UVC_PAN_TILT_MAX	36000
+
 typedef int (*uvc_open_camera_callback)(int width, int height);
 void register_uvc_open_camera(uvc_open_camera_callback cb);
 typedef void (*uvc_close_camera_callback)(void);
 void register_uvc_close_camera(uvc_close_camera_callback cb);
+/*
+ * Gets the metadata of every frame handed to the encoder, whatever the
+ * format, e.g. to feed a UVC metadata node or for YUYV, which has no
+ * place for it in the frame. Called once per stream, from
+ * uvc_read_camera_buffer* or a stream's worker thread, must not call
+ * back into uvc_control. Register it before uvc_control_run().
+ */
+struct uvc_meta;
+typedef void (*uvc_meta_sink_callback)(unsigned int fcc,
+                                       const struct uvc_meta *meta, int count);
+void register_uvc_meta_sink(uvc_meta_sink_callback cb);
+
+/*
+ * Keep the camera streaming at width x height across STREAMON/STREAMOFF
+ * and produce every committed format by crop/scale from that capture.
+ * Must be called before uvc_control_run(); 0 x 0 restores the default
+ * of reopening the camera at the committed resolution.
+ */
+void uvc_control_fixed_capture(int width, int height);
+
+/*
+ * Encode MJPEG/H.264 on a pipelined encoder thread, so the next frame
+ * is submitted while the previous packet is still being collected.
+ * Takes effect on the next STREAMON.
+ */
+void uvc_control_async_encode(bool enable);
+
+/*
+ * Create the MJPEG/H.264/H.265 encoder for a format the host is likely
+ * to pick, so its first STREAMON reuses it instead of creating one.
+ * Up to MPI_ENC_POOL_SIZE stopped encoders are kept until
+ * uvc_control_join().
+ */
+int uvc_control_prewarm(int width, int height, int fcc);
+
+/*
+ * Encode H.264/H.265 in slices of about bytes each and build the uvc
+ * frame as the slices arrive instead of after the whole frame. Replaces
+ * async encode for those formats, 0 turns it off. Takes effect on the
+ * next STREAMON.
+ */
+void uvc_control_slice_encode(int bytes);
+
+/*
+ * Encode H.264/H.265 with intra refresh instead of periodic IDR frames
+ * and a tight CBR window, so frame sizes stay flat. baseline also makes
+ * H.264 constrained baseline (CAVLC) for hosts that need it. Takes effect
+ * for encoders created after the call.
+ */
+void uvc_control_low_latency(bool enable, bool baseline);
+
+/*
+ * Encoder used for streams started after the call: "mpp" (VPU, the
+ * default), "cpu" (libjpeg, MJPEG only) or "auto" (VPU, MJPEG moves to
+ * the CPU when the VPU fails). Returns -1 for an unknown or unbuilt one.
+ */
+int uvc_control_encode_backend(const char *name);
+
+/*
+ * Make the next H.264/H.265 frame of video_id an IDR frame, e.g. when a
+ * host joins mid-stream or lost a frame. video_id < 0 asks every running
+ * stream. Ignored for MJPEG and YUYV.
+ */
+void uvc_control_request_idr(int video_id);
+
+/*
+ * Lower the MJPEG quant when frames outgrow what the USB link moves in
+ * one frame interval or the gadget falls behind, and raise it again up
+ * to the configured quant when there is headroom. On by default.
+ */
+void uvc_control_adaptive_quant(bool enable);
 
+/*
+ * Keep every encoded frame within bytes, below the dwMaxVideoFrameSize
+ * the host committed to. An MJPEG frame over it is encoded again at a
+ * lower quant, an H.264/H.265 frame is dropped and an IDR follows.
+ * 0, the default, leaves only dwMaxVideoFrameSize.
+ */
+void uvc_control_frame_size_cap(size_t bytes);
+
+/*
+ * Frame rate of every running stream and of those started without one.
+ * The gadget passes the rate the host committed (dwFrameInterval) to
+ * uvc_control_init instead.
+ */
+void uvc_control_set_fps(int fps);
+/*
+ * Runtime rate control, applied to the encoder of every running stream.
+ * Returns -1 when there is none or one of them fails.
+ */
+struct MpiEncRcParam;
+int uvc_control_set_rc(const struct MpiEncRcParam *param);
+
+/* Crop applied to the camera frame, takes effect on the next frame. */
+void uvc_control_set_zoom(int zoom);
+void uvc_control_set_pantilt(int pan, int tilt);
+
+/*
+ * Finds every uvc gadget video node and the uvc.* configfs function
+ * behind it; add_uvc_video starts a gadget thread for each of them.
+ */
 void add_uvc_video();
 int check_uvc_video_id(void);
-void uvc_control_init(int width, int height, int fcc);
-void uvc_control_exit();
+/*
+ * Start and stop the stream of one uvc function. Every stream owns its
+ * encoder and worker thread, so functions streaming different formats
+ * encode side by side on separate VPU channels. The camera opens with
+ * the first stream at its size (or the fixed capture size) and closes
+ * with the last one; later streams of another size scale from it.
+ * uvc_control_init returns -1 and leaves the function off when its
+ * encoder cannot be set up.
+ */
+int uvc_control_init(int video_id, int width, int height, int fcc, int fps);
+void uvc_control_exit(int video_id);
+/* extra_data goes with the frame as one UVC_META_RAW item */
 void uvc_read_camera_buffer(void *cam_buf, int cam_fd, size_t cam_size,
                             void* extra_data, size_t extra_size);
-int get_uvc_streaming_intf(void);
+/*
+ * As uvc_read_camera_buffer, and code the regions of interest in roi
+ * (camera frame pixels, e.g. detected faces) at their own qp for
+ * H.264/H.265. They apply from this frame until the next call, count 0
+ * clears them.
+ */
+struct MpiEncRoiRegion;
+void uvc_read_camera_buffer_roi(void *cam_buf, int cam_fd, size_t cam_size,
+                                void* extra_data, size_t extra_size,
+                                const struct MpiEncRoiRegion *roi, int count);
+/*
+ * As uvc_read_camera_buffer_roi, with up to UVC_META_MAX typed items of
+ * metadata for this frame, see uvc_meta.h for how each format carries
+ * them. The data only has to stay valid during the call.
+ */
+void uvc_read_camera_buffer_meta(void *cam_buf, int cam_fd, size_t cam_size,
+                                 const struct uvc_meta *meta, int meta_count,
+                                 const struct MpiEncRoiRegion *roi, int count);
+
+/*
+ * As uvc_read_camera_buffer_meta for a uvc_frame, which carries its own
+ * metadata. The async encoder may keep a reference after the call.
+ */
+struct uvc_frame;
+void uvc_read_camera_frame(struct uvc_frame *frame);
+/*
+ * Queue the frame for the worker thread of every running stream and
+ * return at once, so the camera thread can dequeue the next frame while
+ * this one is converted and encoded. Each worker takes its own
+ * reference; the caller drops its one when done. Per stream one frame is
+ * encoded and one waits; a newer frame replaces the waiting one, which
+ * is dropped unencoded. Returns -1, without taking a reference, when no
+ * stream is running.
+ */
+int uvc_submit_frame(struct uvc_frame *frame);
+/*
+ * Wait until every worker has processed the frames submitted to it. The async
+ * encoder may still hold some; their release tells the producer.
+ */
+void uvc_submit_flush(void);
+/*
+ * Streaming interface number of the uvc function bound to video_id, as
+ * found in configfs by check_uvc_video_id, -1 when unknown.
+ */
+int get_uvc_streaming_intf(int video_id);
 void uvc_control_signal(void);
 int uvc_control_run(uint32_t flags);
 void uvc_control_join(uint32_t flags);
@@ -32,83 +32,894 @@
 
 #include "uvc_encode.h"
 #include "uvc_video.h"
+#include "uvc_control.h"
+#include "uvc_meta.h"
+#include "uvc_frame.h"
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef HAVE_JPEG_ENC
+#include "jpeg_enc.h"
+#endif
 
-int uvc_encode_init(struct uvc_encode *e, int width, int height,int fcc)
+static enum uvc_encode_backend encode_backend = UVC_ENCODE_MPP;
+
+/*
+ * Largest frame the host takes: the committed dwMaxVideoFrameSize, or the
+ * size cap when that is lower. 0 for no limit.
+ */
+static size_t uvc_encode_frame_limit(struct uvc_encode *e)
+{
+    size_t max = uvc_get_user_max_frame_size(e->video_id);
+
+    if (e->size_cap && (!max || e->size_cap < max))
+        max = e->size_cap;
+    return max;
+}
+
+static bool uvc_encode_fits(struct uvc_encode *e, size_t extra_size, size_t len)
 {
-    printf("%s: width = %d, height = %d, fcc = %d\n", __func__, width, height,fcc);
+    size_t limit = uvc_encode_frame_limit(e);
+
+    return !limit || extra_size + len <= limit;
+}
+
+/* (re)fetch SPS/PPS (and VPS), they change with the size and rate control */
+static int uvc_encode_mpp_get_ps(struct uvc_encode *e)
+{
+    size_t size = 10240;
+
+    if (!e->ps_data) {
+        e->ps_data = calloc(size, 1);
+        if (!e->ps_data)
+            return -1;
+    }
+    if (mpi_enc_get_extra(e->mpi_data, e->ps_data, &size))
+        return -1;
+    e->ps_size = size;
+    e->extra_data = e->ps_data;
+    e->extra_size = e->ps_size;
+
+    return 0;
+}
+
+static int uvc_encode_mpp_init(struct uvc_encode *e)
+{
+    int fcc = e->fcc;
+
+    if (mpi_enc_pool_get(&e->mpi_cmd, &e->mpi_data) != MPP_OK) {
+        if (e->mpi_data)
+            mpi_enc_test_deinit(&e->mpi_data);
+        return -1;
+    }
+    /* a pooled encoder keeps the quant the host set on it */
+    if (fcc == V4L2_PIX_FMT_MJPEG &&
+        (e->mpi_data->rc_user.change & MPI_ENC_RC_CHANGE_QP)) {
+        e->quant = e->mpi_data->rc_user.qp;
+        e->quant_max = e->quant;
+    }
+    /* one more than can be in flight in async mode */
+    if (mpi_enc_set_output_pool(e->mpi_data, MPI_ENC_ASYNC_DEPTH + 2) != MPP_OK)
+        printf("%s: no output pool, use mpp packets\n", __func__);
+    if (fcc == V4L2_PIX_FMT_H264 || fcc == V4L2_PIX_FMT_HEVC)
+        return uvc_encode_mpp_get_ps(e);
+
+    return 0;
+}
+
+static void uvc_encode_mpp_exit(struct uvc_encode *e)
+{
+    int i;
+
+    if (e->async) {
+        mpi_enc_async_stop(e->mpi_data);
+        for (i = 0; i < UVC_ENCODE_JOBS; i++) {
+            free(e->jobs[i].extra_data);
+            e->jobs[i].extra_data = NULL;
+            e->jobs[i].extra_alloc = 0;
+        }
+        sem_destroy(&e->input_sem);
+        pthread_mutex_destroy(&e->job_lock);
+        e->async = false;
+    }
+    if (e->mpi_data)
+        mpi_enc_pool_put(&e->mpi_data);
+    e->slice = false;
+    if (e->ps_data) {
+        free(e->ps_data);
+        e->ps_data = NULL;
+    }
+}
+
+static int uvc_encode_mpp_set_quant(struct uvc_encode *e, int quant)
+{
+    return mpi_enc_set_quant(e->mpi_data, quant) == MPP_OK ? 0 : -1;
+}
+
+static int uvc_encode_mpp_process(struct uvc_encode *e, unsigned int fcc,
+                                  void *virt, int fd, size_t size);
+
+static const struct uvc_encode_ops uvc_encode_mpp_ops = {
+    "mpp",
+    uvc_encode_mpp_init,
+    uvc_encode_mpp_exit,
+    uvc_encode_mpp_process,
+    uvc_encode_mpp_set_quant,
+};
+
+#ifdef HAVE_JPEG_ENC
+/* MJPEG quant 1-10 to libjpeg quality, the default 7 is about 68 */
+static int uvc_encode_cpu_quality(int quant)
+{
+    return quant * 9 + 5;
+}
+
+static int uvc_encode_cpu_init(struct uvc_encode *e)
+{
+    if (e->fcc != V4L2_PIX_FMT_MJPEG)
+        return -1;
+    /* restart interval bands on every core */
+    e->jpeg = jpeg_enc_create(e->width, e->height, e->src.fcc, 0);
+    if (!e->jpeg)
+        return -1;
+    jpeg_enc_set_quality(e->jpeg, uvc_encode_cpu_quality(e->quant));
+
+    return 0;
+}
+
+static void uvc_encode_cpu_exit(struct uvc_encode *e)
+{
+    jpeg_enc_destroy(e->jpeg);
+    e->jpeg = NULL;
+}
+
+static int uvc_encode_cpu_process(struct uvc_encode *e, unsigned int fcc,
+                                  void *virt, int fd, size_t size)
+{
+    void *data;
+    size_t len;
+
+    if (!virt)
+        return 0;
+    if (jpeg_enc_encode(e->jpeg, virt, &data, &len))
+        return -1;
+    e->last_len = len;
+    if (!uvc_encode_fits(e, e->extra_size, len))
+        return 1;
+    uvc_buffer_write(0, e->extra_data, e->extra_size, data, len, NULL, fcc,
+                     e->video_id);
+
+    return 0;
+}
+
+static int uvc_encode_cpu_set_quant(struct uvc_encode *e, int quant)
+{
+    jpeg_enc_set_quality(e->jpeg, uvc_encode_cpu_quality(quant));
+
+    return 0;
+}
+
+static const struct uvc_encode_ops uvc_encode_cpu_ops = {
+    "cpu",
+    uvc_encode_cpu_init,
+    uvc_encode_cpu_exit,
+    uvc_encode_cpu_process,
+    uvc_encode_cpu_set_quant,
+};
+#endif
+
+int uvc_encode_set_backend(enum uvc_encode_backend backend)
+{
+#ifndef HAVE_JPEG_ENC
+    if (backend == UVC_ENCODE_CPU) {
+        printf("%s: built without the cpu jpeg encoder\n", __func__);
+        return -1;
+    }
+#endif
+    encode_backend = backend;
+
+    return 0;
+}
+
+/*
+ * Move an MJPEG stream from the VPU to the CPU encoder, for
+ * UVC_ENCODE_AUTO when the VPU cannot take or keep the session.
+ */
+static int uvc_encode_fallback(struct uvc_encode *e)
+{
+#ifdef HAVE_JPEG_ENC
+    if (encode_backend != UVC_ENCODE_AUTO || e->fcc != V4L2_PIX_FMT_MJPEG ||
+        e->ops == &uvc_encode_cpu_ops)
+        return -1;
+    printf("%s: %s encoder failed, use cpu\n", __func__,
+           e->ops ? e->ops->name : "no");
+    if (e->ops)
+        e->ops->exit(e);
+    e->ops = &uvc_encode_cpu_ops;
+    e->fail_count = 0;
+    if (e->ops->init(e)) {
+        e->ops = NULL;
+        return -1;
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+int uvc_encode_init(struct uvc_encode *e, int width, int height, int fcc, int fps)
+{
+    printf("%s: width = %d, height = %d, fcc = %d, fps = %d\n", __func__,
+           width, height, fcc, fps);
     memset(e, 0, sizeof(*e));
     e->video_id = -1;
-    e->width = -1;
-    e->height = -1;
     e->width = width;
     e->height = height;
     e->fcc = fcc;
     mpi_enc_cmd_config(&e->mpi_cmd, width, height, fcc);
+    e->mpi_cmd.fps = fps;
+    e->src.fcc = mpi_enc_fmt_to_fcc(e->mpi_cmd.format);
+    e->src.width = width;
+    e->src.height = height;
     //mpi_enc_cmd_config_mjpg(&e->mpi_cmd, width, height);
     if(fcc == V4L2_PIX_FMT_YUYV)
         return 0;
-    if (mpi_enc_test_init(&e->mpi_cmd, &e->mpi_data) != MPP_OK)
+    e->quant = MPI_ENC_JPEG_QUANT;
+    e->quant_max = MPI_ENC_JPEG_QUANT;
+    e->ops = &uvc_encode_mpp_ops;
+#ifdef HAVE_JPEG_ENC
+    if (encode_backend == UVC_ENCODE_CPU && fcc == V4L2_PIX_FMT_MJPEG)
+        e->ops = &uvc_encode_cpu_ops;
+#endif
+    if (e->ops->init(e)) {
+        e->ops->exit(e);
+        e->ops = NULL;
+        return uvc_encode_fallback(e);
+    }
+    printf("%s: %s encoder\n", __func__, e->ops->name);
+
+    return 0;
+}
+
+/*
+ * Create the encoder of a stream before the host asks for it, so that
+ * its STREAMON only has to set it up again.
+ */
+int uvc_encode_prewarm(int width, int height, int fcc)
+{
+    MpiEncTestCmd cmd;
+    MpiEncTestData *p = NULL;
+
+    if (fcc == V4L2_PIX_FMT_YUYV ||
+        (encode_backend == UVC_ENCODE_CPU && fcc == V4L2_PIX_FMT_MJPEG))
+        return 0;
+    mpi_enc_cmd_config(&cmd, width, height, fcc);
+    if (mpi_enc_pool_get(&cmd, &p) != MPP_OK) {
+        if (p)
+            mpi_enc_test_deinit(&p);
+        return -1;
+    }
+    mpi_enc_set_output_pool(p, MPI_ENC_ASYNC_DEPTH + 2);
+    mpi_enc_pool_put(&p);
+
+    return 0;
+}
+
+/* where the scale pass writes the width x height NV12 frame */
+static int uvc_encode_scale_alloc(struct uvc_encode *e)
+{
+    size_t len = e->width * e->height * 3 / 2;
+
+#ifdef HAVE_JPEG_ENC
+    /* libjpeg reads plain memory, only mpp needs a dma buffer */
+    if (e->ops == &uvc_encode_cpu_ops) {
+        e->scale_virt = malloc(len);
+        return e->scale_virt ? 0 : -1;
+    }
+#endif
+    if (mpp_buffer_get(NULL, &e->scale_buf, len))
+        return -1;
+    e->scale_virt = mpp_buffer_get_ptr(e->scale_buf);
+
+    return 0;
+}
+
+/*
+ * Pick the largest centered crop of the camera frame with the output
+ * aspect ratio, shrink it by the zoom factor and move it by pan/tilt
+ * within the remaining margin. The crop is applied while scaling, so it
+ * takes effect on the next frame.
+ */
+static int uvc_encode_update_crop(struct uvc_encode *e)
+{
+    struct yuv_frame *f = &e->src;
+    int w, h, x, y;
+    int zoom = e->zoom > UVC_ZOOM_MIN ? e->zoom : UVC_ZOOM_MIN;
+
+    if ((long)f->width * e->height > (long)f->height * e->width) {
+        h = f->height;
+        w = (int)((long)f->height * e->width / e->height);
+    } else {
+        w = f->width;
+        h = (int)((long)f->width * e->height / e->width);
+    }
+    w = (w * UVC_ZOOM_MIN / zoom) & ~1;
+    h = (h * UVC_ZOOM_MIN / zoom) & ~1;
+    if (w < 2 || h < 2)
+        return -1;
+    x = (f->width - w) / 2;
+    y = (f->height - h) / 2;
+    /* positive pan looks right, positive tilt looks up */
+    x += (int)((long)x * e->pan / UVC_PAN_TILT_MAX);
+    y -= (int)((long)y * e->tilt / UVC_PAN_TILT_MAX);
+
+    if (w == f->width && h == f->height &&
+        w == e->width && h == e->height) {
+        f->crop_x = f->crop_y = f->crop_w = f->crop_h = 0;
+        e->scale = false;
+        return 0;
+    }
+    if (f->fcc != V4L2_PIX_FMT_NV12) {
+        printf("%s: crop/scale needs NV12 input\n", __func__);
+        return -1;
+    }
+    f->crop_x = x & ~1;
+    f->crop_y = y & ~1;
+    f->crop_w = w;
+    f->crop_h = h;
+    if (e->fcc != V4L2_PIX_FMT_YUYV && !e->scale_virt) {
+        if (uvc_encode_scale_alloc(e)) {
+            printf("%s: get scale buffer failed\n", __func__);
+            return -1;
+        }
+    }
+    e->scale = true;
+
+    return 0;
+}
+
+/*
+ * Let the camera deliver width x height and produce the committed size
+ * from it, so a format switch does not need to restart the sensor.
+ */
+int uvc_encode_set_capture(struct uvc_encode *e, int width, int height)
+{
+    e->src.width = width;
+    e->src.height = height;
+    if (uvc_encode_update_crop(e))
+        return -1;
+    printf("%s: %dx%d crop %dx%d@%d,%d -> %dx%d\n", __func__, width, height,
+           e->src.crop_w, e->src.crop_h, e->src.crop_x, e->src.crop_y,
+           e->width, e->height);
+
+    return 0;
+}
+
+int uvc_encode_set_roi(struct uvc_encode *e, int zoom, int pan, int tilt)
+{
+    e->zoom = zoom;
+    e->pan = pan;
+    e->tilt = tilt;
+
+    return uvc_encode_update_crop(e);
+}
+
+/*
+ * MPP has no crop in the prep config this encoder uses, so the crop is
+ * folded into the scale pass into the encoder input buffer instead.
+ */
+static int uvc_encode_scale(struct uvc_encode *e, void *virt)
+{
+    struct yuv_nv12 src, dst;
+
+    if (!e->scaler && !(e->scaler = yuv_scaler_create()))
         return -1;
-    if (fcc == V4L2_PIX_FMT_H264) {
-        e->h264_extra_data = calloc(10240, 1);
-        if (!e->h264_extra_data)
+    yuv_nv12_crop(&src, &e->src, virt);
+    yuv_nv12_init(&dst, e->scale_virt, e->width, e->height);
+
+    return yuv_scaler_nv12(e->scaler, &src, &dst);
+}
+
+/*
+ * roi is in camera frame pixels. Map it through the zoom/pan crop to the
+ * encoder input, dropping what falls outside the crop.
+ */
+int uvc_encode_set_roi_regions(struct uvc_encode *e, const MpiEncRoiRegion *roi,
+                               int count)
+{
+    MpiEncRoiRegion r[MPI_ENC_ROI_MAX];
+    struct yuv_frame *f = &e->src;
+    int i, n = 0;
+    int x0, y0, x1, y1;
+
+    if ((e->fcc != V4L2_PIX_FMT_H264 && e->fcc != V4L2_PIX_FMT_HEVC) ||
+        !e->mpi_data)
+        return -1;
+
+    for (i = 0; i < count && n < MPI_ENC_ROI_MAX; i++) {
+        r[n] = roi[i];
+        if (e->scale && f->crop_w > 0 && f->crop_h > 0) {
+            x0 = MPP_MAX(roi[i].x - f->crop_x, 0);
+            y0 = MPP_MAX(roi[i].y - f->crop_y, 0);
+            x1 = MPP_MIN(roi[i].x + roi[i].w - f->crop_x, f->crop_w);
+            y1 = MPP_MIN(roi[i].y + roi[i].h - f->crop_y, f->crop_h);
+            if (x0 >= x1 || y0 >= y1)
+                continue;
+            r[n].x = x0 * e->width / f->crop_w;
+            r[n].y = y0 * e->height / f->crop_h;
+            r[n].w = (x1 - x0) * e->width / f->crop_w;
+            r[n].h = (y1 - y0) * e->height / f->crop_h;
+        }
+        n++;
+    }
+
+    return mpi_enc_set_roi_regions(e->mpi_data, r, n) ? -1 : 0;
+}
+
+/* Change bitrate/fps/gop/qp/rc mode of the running encoder. */
+int uvc_encode_set_rc(struct uvc_encode *e, const MpiEncRcParam *param)
+{
+    if (e->fcc == V4L2_PIX_FMT_YUYV || !e->ops)
+        return 0;
+    if (e->mpi_data) {
+        if (mpi_enc_set_rc(e->mpi_data, param) != MPP_OK)
             return -1;
-        e->h264_extra_size = 10240;
-        if (mpi_enc_get_h264_extra(e->mpi_data, e->h264_extra_data, &e->h264_extra_size)) {
-            free(e->h264_extra_data);
+        if (e->ps_data && (param->change & ~MPI_ENC_RC_CHANGE_QP) &&
+            uvc_encode_mpp_get_ps(e))
+            printf("%s: refresh parameter sets failed\n", __func__);
+    } else if (param->change & MPI_ENC_RC_CHANGE_QP) {
+        /* the cpu encoder only has a quant */
+        e->ops->set_quant(e, param->qp);
+    }
+    /* an explicit quant is the best quality adaptive quant goes back to */
+    if (e->fcc == V4L2_PIX_FMT_MJPEG && (param->change & MPI_ENC_RC_CHANGE_QP)) {
+        e->quant = param->qp;
+        e->quant_max = param->qp;
+        e->quant_hold = 0;
+    }
+    return 0;
+}
+
+void uvc_encode_set_adaptive_quant(struct uvc_encode *e, bool enable)
+{
+    e->adaptive_quant = enable && e->fcc == V4L2_PIX_FMT_MJPEG;
+    e->quant_hold = 0;
+    e->quant_settle = 0;
+    e->last_len = 0;
+}
+
+/*
+ * uvc_encode_process asks mpp for the IDR right before the next frame
+ * goes in. idr_pending is also set from the async collect thread, so it
+ * is only touched atomically.
+ */
+void uvc_encode_request_idr(struct uvc_encode *e)
+{
+    __atomic_store_n(&e->idr_pending, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Carry the items with the next frame in the APP segments or SEI of its
+ * format, see uvc_meta_pack. H.264/H.265 keep the parameter sets first.
+ */
+int uvc_encode_set_meta(struct uvc_encode *e, const struct uvc_meta *meta,
+                        int count)
+{
+    size_t size = uvc_meta_pack_size(e->fcc, meta, count);
+    size_t ps = e->ps_data ? e->ps_size : 0;
+
+    e->extra_data = e->ps_data;
+    e->extra_size = ps;
+    if (!size)
+        return 0;
+    if (e->meta_alloc < ps + size) {
+        void *buf = realloc(e->meta_buf, ps + size);
+
+        if (!buf) {
+            printf("%s: realloc %zu fail\n", __func__, ps + size);
             return -1;
         }
+        e->meta_buf = buf;
+        e->meta_alloc = ps + size;
     }
+    if (ps)
+        memcpy(e->meta_buf, e->ps_data, ps);
+    e->extra_data = e->meta_buf;
+    e->extra_size = ps + uvc_meta_pack(e->fcc, meta, count,
+                                       (char *)e->meta_buf + ps, size);
 
     return 0;
 }
 
+void uvc_encode_set_size_cap(struct uvc_encode *e, size_t bytes)
+{
+    e->size_cap = bytes;
+}
+
+/*
+ * Keep MJPEG frames within what the link moves in one frame interval.
+ * The quant drops as soon as a frame is over budget or the gadget
+ * dequeues slower than the frame rate, and goes back up one step after
+ * UVC_QUANT_HOLD frames with headroom.
+ */
+static void uvc_encode_update_quant(struct uvc_encode *e, size_t len)
+{
+    int fps = e->mpi_data ? e->mpi_data->fps : e->mpi_cmd.fps;
+    unsigned int rate = uvc_get_user_link_rate(e->video_id);
+    unsigned int interval = uvc_get_dqbuf_interval(e->video_id);
+    unsigned int frame_us = 1000000 / (fps > 0 ? fps : 30);
+    /* leave 10% for payload headers */
+    size_t budget = rate / 10 * 9 / (fps > 0 ? fps : 30);
+    bool over = budget && len > budget;
+    bool late = interval > frame_us * 5 / 4;
+    int quant = e->quant;
+
+    /* small frames going out late mean a slow camera, not a full link */
+    if (late && budget && len < budget / 2)
+        late = false;
+    if (e->quant_settle > 0) {
+        e->quant_settle--;
+        return;
+    }
+    if (over || late) {
+        quant -= over && len > budget * 5 / 4 ? 2 : 1;
+        e->quant_hold = 0;
+    } else if (!budget || len < budget * 3 / 4) {
+        if (++e->quant_hold >= UVC_QUANT_HOLD) {
+            quant++;
+            e->quant_hold = 0;
+        }
+    } else {
+        e->quant_hold = 0;
+    }
+    if (quant < 1)
+        quant = 1;
+    if (quant > e->quant_max)
+        quant = e->quant_max;
+    if (quant == e->quant)
+        return;
+
+    if (e->ops->set_quant(e, quant) == 0) {
+        printf("%s: %zu bytes, budget %zu, dqbuf %u us, quant %d -> %d\n",
+               __func__, len, budget, interval, e->quant, quant);
+        e->quant = quant;
+        e->quant_settle = UVC_QUANT_SETTLE;
+    }
+}
+
+/* Size of the last MJPEG frame written to the gadget, 0 if none since. */
+static size_t uvc_encode_take_len(struct uvc_encode *e)
+{
+    size_t len;
+
+    if (!e->async) {
+        len = e->last_len;
+        e->last_len = 0;
+        return len;
+    }
+    pthread_mutex_lock(&e->job_lock);
+    len = e->last_len;
+    e->last_len = 0;
+    pthread_mutex_unlock(&e->job_lock);
+    return len;
+}
+
+static void uvc_encode_input_done(void *frame_user, void *user)
+{
+    struct uvc_encode *e = (struct uvc_encode *)user;
+    struct uvc_encode_job *job = (struct uvc_encode_job *)frame_user;
+    struct uvc_frame *frame = job->frame;
+
+    /* a held frame replaces waiting in uvc_encode_submit */
+    if (frame) {
+        job->frame = NULL;
+        uvc_frame_put(frame);
+    } else {
+        sem_post(&e->input_sem);
+    }
+}
+
+static void uvc_encode_packet_done(void *data, size_t len, void *frame_user,
+                                   void *user)
+{
+    struct uvc_encode *e = (struct uvc_encode *)user;
+    struct uvc_encode_job *job = (struct uvc_encode_job *)frame_user;
+    bool drop = false;
+
+    /* the frame is gone, too late to encode it again */
+    if (data && len && !uvc_encode_fits(e, job->extra_size, len)) {
+        printf("%s: %zu byte frame over %zu, drop\n", __func__, len,
+               uvc_encode_frame_limit(e));
+        drop = true;
+    } else if (data && len && uvc_get_user_run_state(e->video_id) &&
+               uvc_buffer_write_enable(e->video_id)) {
+        uvc_buffer_write(0, job->extra_data, job->extra_size,
+                         data, len, NULL, e->fcc, e->video_id);
+    }
+    pthread_mutex_lock(&e->job_lock);
+    job->busy = false;
+    if (data)
+        e->last_len = len;
+    /* picked up with the next frame, the ones in flight still refer back */
+    pthread_mutex_unlock(&e->job_lock);
+    if (drop && e->fcc != V4L2_PIX_FMT_MJPEG)
+        uvc_encode_request_idr(e);
+}
+
+/*
+ * Encode on the mpi_enc submit/collect threads: packet N is written to
+ * the uvc buffer while the VPU already encodes frame N + 1.
+ */
+int uvc_encode_set_async(struct uvc_encode *e)
+{
+    int i;
+
+    /* slices are collected on the camera thread, see uvc_encode_set_slice */
+    if (e->fcc == V4L2_PIX_FMT_YUYV || e->async || e->slice)
+        return 0;
+    if (!e->mpi_data)
+        return -1;
+    for (i = 0; i < UVC_ENCODE_JOBS; i++)
+        e->jobs[i].e = e;
+    pthread_mutex_init(&e->job_lock, NULL);
+    sem_init(&e->input_sem, 0, 0);
+    if (mpi_enc_async_start(e->mpi_data, uvc_encode_input_done,
+                            uvc_encode_packet_done, e) != MPP_OK) {
+        sem_destroy(&e->input_sem);
+        pthread_mutex_destroy(&e->job_lock);
+        return -1;
+    }
+    e->async = true;
+
+    return 0;
+}
+
+static void uvc_encode_slice_done(void *data, size_t len, RK_U32 last,
+                                  void *user)
+{
+    struct uvc_encode *e = (struct uvc_encode *)user;
+
+    uvc_buffer_write_slice(e->extra_data, e->extra_size, data, len, last,
+                           e->video_id);
+}
+
+/*
+ * Encode H.264/H.265 in slices of about bytes each and copy every slice
+ * into the uvc buffer as soon as mpp returns it, so the frame is ready
+ * for the gadget right after its last slice. Must be set before
+ * uvc_encode_set_async, which it replaces.
+ */
+int uvc_encode_set_slice(struct uvc_encode *e, int bytes)
+{
+    if (e->fcc != V4L2_PIX_FMT_H264 && e->fcc != V4L2_PIX_FMT_HEVC)
+        return 0;
+    if (!e->mpi_data || e->async)
+        return -1;
+    if (mpi_enc_set_split(e->mpi_data, bytes) != MPP_OK)
+        return -1;
+    e->slice = bytes > 0;
+
+    return 0;
+}
+
+static void uvc_encode_submit(struct uvc_encode *e, int fd, size_t size)
+{
+    struct uvc_encode_job *job = NULL;
+    bool held;
+    int i;
+
+    pthread_mutex_lock(&e->job_lock);
+    for (i = 0; i < UVC_ENCODE_JOBS; i++) {
+        if (!e->jobs[i].busy) {
+            job = &e->jobs[i];
+            job->busy = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&e->job_lock);
+    if (!job) {
+        printf("%s: encoder busy, drop frame\n", __func__);
+        return;
+    }
+
+    /* e->extra_data changes with the next frame */
+    job->extra_size = 0;
+    if (e->extra_data && e->extra_size) {
+        if (job->extra_alloc < e->extra_size) {
+            void *data = realloc(job->extra_data, e->extra_size);
+            if (data) {
+                job->extra_data = data;
+                job->extra_alloc = e->extra_size;
+            }
+        }
+        if (job->extra_alloc >= e->extra_size) {
+            memcpy(job->extra_data, e->extra_data, e->extra_size);
+            job->extra_size = e->extra_size;
+        }
+    }
+
+    /* the camera frame itself goes to the VPU, hold it instead of waiting */
+    job->frame = e->frame && e->frame->fd == fd ? uvc_frame_get(e->frame) : NULL;
+    held = job->frame != NULL;
+    if (mpi_enc_async_put(e->mpi_data, fd, size, job) != MPP_OK) {
+        if (job->frame) {
+            uvc_frame_put(job->frame);
+            job->frame = NULL;
+        }
+        pthread_mutex_lock(&e->job_lock);
+        job->busy = false;
+        pthread_mutex_unlock(&e->job_lock);
+        return;
+    }
+    /* the camera, or the next scale, takes the buffer back when we return */
+    if (!held)
+        sem_wait(&e->input_sem);
+}
+
 void uvc_encode_exit(struct uvc_encode *e)
 {
-    if(e->fcc != V4L2_PIX_FMT_YUYV)
-        mpi_enc_test_deinit(&e->mpi_data);
+    if (e->ops) {
+        e->ops->exit(e);
+        e->ops = NULL;
+    }
     e->video_id = -1;
     e->width = -1;
     e->height = -1;
-    if (e->fcc == V4L2_PIX_FMT_H264 && e->h264_extra_data) {
-        free(e->h264_extra_data);
-        e->h264_extra_data = NULL;
+    if (e->scale_buf) {
+        mpp_buffer_put(e->scale_buf);
+        e->scale_buf = NULL;
+    } else {
+        free(e->scale_virt);
+    }
+    e->scale_virt = NULL;
+    yuv_scaler_destroy(e->scaler);
+    e->scaler = NULL;
+    e->scale = false;
+    free(e->meta_buf);
+    e->meta_buf = NULL;
+    e->meta_alloc = 0;
+    e->extra_data = NULL;
+    e->extra_size = 0;
+}
+
+static int uvc_encode_mpp_process(struct uvc_encode *e, unsigned int fcc,
+                                  void *virt, int fd, size_t size)
+{
+    RK_U32 overflow;
+
+    /* no use growing the packet buffers past what the host takes */
+    mpi_enc_set_max_packet(e->mpi_data, uvc_get_user_max_frame_size(e->video_id));
+    switch (fcc) {
+    case V4L2_PIX_FMT_MJPEG:
+        if (fd >= 0 && e->async) {
+            uvc_encode_submit(e, fd, size);
+            break;
+        }
+        if (fd < 0)
+            break;
+        overflow = __atomic_load_n(&e->mpi_data->overflow_count, __ATOMIC_RELAXED);
+        if (mpi_enc_test_run(&e->mpi_data, fd, size) != MPP_OK)
+            /* cut short by a full packet buffer, grown for the next try */
+            return __atomic_load_n(&e->mpi_data->overflow_count, __ATOMIC_RELAXED) !=
+                   overflow ? 1 : -1;
+        e->last_len = e->mpi_data->enc_len;
+        if (!uvc_encode_fits(e, e->extra_size, e->mpi_data->enc_len))
+            return 1;
+        uvc_buffer_write(0, e->extra_data, e->extra_size,
+                         e->mpi_data->enc_data, e->mpi_data->enc_len, NULL, fcc, e->video_id);
+        break;
+    case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
+        if (fd >= 0 && __atomic_exchange_n(&e->idr_pending, false, __ATOMIC_ACQ_REL))
+            mpi_enc_request_idr(e->mpi_data);
+        if (fd >= 0 && e->slice) {
+            mpi_enc_run_slices(e->mpi_data, fd, size, uvc_encode_slice_done, e);
+            break;
+        }
+        if (fd >= 0 && e->async) {
+            uvc_encode_submit(e, fd, size);
+            break;
+        }
+        if (fd < 0)
+            break;
+        overflow = __atomic_load_n(&e->mpi_data->overflow_count, __ATOMIC_RELAXED);
+        if (mpi_enc_test_run(&e->mpi_data, fd, size) != MPP_OK)
+            return __atomic_load_n(&e->mpi_data->overflow_count, __ATOMIC_RELAXED) !=
+                   overflow ? 1 : -1;
+        if (!uvc_encode_fits(e, e->extra_size, e->mpi_data->enc_len))
+            return 1;
+        uvc_buffer_write(0, e->extra_data, e->extra_size,
+                         e->mpi_data->enc_data, e->mpi_data->enc_len, NULL, fcc, e->video_id);
+        break;
+    default:
+        printf("%s: not support fcc: %u\n", __func__, fcc);
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Encode with ops->process. An MJPEG frame over the size limit is encoded
+ * again at a lower quant, up to UVC_ENCODE_RESIZE_MAX times, instead of
+ * being dropped. Without adaptive quant the quant goes back afterwards.
+ * An H.264/H.265 frame over it is dropped and the next one made an IDR.
+ */
+static int uvc_encode_run(struct uvc_encode *e, unsigned int fcc, void *virt,
+                          int fd, size_t size)
+{
+    int quant = e->quant;
+    int ret, i, q;
+
+    for (i = 0; ; i++) {
+        ret = e->ops->process(e, fcc, virt, fd, size);
+        if (ret <= 0 || fcc != V4L2_PIX_FMT_MJPEG ||
+            i == UVC_ENCODE_RESIZE_MAX || e->quant <= 1)
+            break;
+        q = e->quant - UVC_ENCODE_RESIZE_STEP;
+        if (q < 1)
+            q = 1;
+        if (e->ops->set_quant(e, q))
+            break;
+        e->quant = q;
+        e->quant_hold = 0;
     }
+    if (ret > 0) {
+        printf("%s: frame over %zu bytes at quant %d, drop\n", __func__,
+               uvc_encode_frame_limit(e), e->quant);
+        if (fcc != V4L2_PIX_FMT_MJPEG)
+            uvc_encode_request_idr(e);
+    } else if (!ret && i) {
+        printf("%s: frame re-encoded at quant %d\n", __func__, e->quant);
+    }
+    if (!e->adaptive_quant && e->quant != quant && !e->ops->set_quant(e, quant))
+        e->quant = quant;
+
+    return ret < 0 ? -1 : 0;
 }
 
 bool uvc_encode_process(struct uvc_encode *e, void *virt, int fd, size_t size)
 {
-    int ret = 0;
     unsigned int fcc;
     int width, height;
-    int jpeg_quant;
-    void* hnd = NULL;
 
     if (!uvc_get_user_run_state(e->video_id) || !uvc_buffer_write_enable(e->video_id))
         return false;
 
+    /* YUYV crops and scales while packing, see yuv_frame_convert */
+    if (e->scale && e->scale_virt) {
+        if (!virt || uvc_encode_scale(e, virt))
+            return false;
+        virt = e->scale_virt;
+        fd = e->scale_buf ? mpp_buffer_get_fd(e->scale_buf) : -1;
+        size = e->width * e->height * 3 / 2;
+    }
+
     uvc_get_user_resolution(&width, &height, e->video_id);
     fcc = uvc_get_user_fcc(e->video_id);
     switch (fcc) {
     case V4L2_PIX_FMT_YUYV:
         if (virt)
-            uvc_buffer_write(0, NULL, 0, virt, width * height * 2, fcc, e->video_id);
+            uvc_buffer_write(0, NULL, 0, virt, width * height * 2, &e->src, fcc, e->video_id);
         break;
     case V4L2_PIX_FMT_MJPEG:
-        if (fd >= 0 && mpi_enc_test_run(&e->mpi_data, fd, size) == MPP_OK) {
-            uvc_buffer_write(0, e->extra_data, e->extra_size,
-                             e->mpi_data->enc_data, e->mpi_data->enc_len, fcc, e->video_id);
+        if (e->adaptive_quant && e->ops) {
+            size_t len = uvc_encode_take_len(e);
+
+            if (len)
+                uvc_encode_update_quant(e, len);
         }
-        break;
+        /* fall through */
     case V4L2_PIX_FMT_H264:
-        e->extra_data = e->h264_extra_data;
-        e->extra_size = e->h264_extra_size;
-        if (fd >= 0 && mpi_enc_test_run(&e->mpi_data, fd, size) == MPP_OK) {
-            uvc_buffer_write(0, e->extra_data, e->extra_size,
-                             e->mpi_data->enc_data, e->mpi_data->enc_len, fcc, e->video_id);
+    case V4L2_PIX_FMT_HEVC:
+        if (!e->ops)
+            break;
+        if (!uvc_encode_run(e, fcc, virt, fd, size)) {
+            e->fail_count = 0;
+            break;
         }
+        if (++e->fail_count >= UVC_ENCODE_FALLBACK_FAILS)
+            uvc_encode_fallback(e);
         break;
     default:
         printf("%s: not support fcc: %u\n", __func__, fcc);
@@ -117,3 +928,26 @@ bool uvc_encode_process(struct uvc_encode *e, void *virt, int fd, size_t size)
 
     return true;
 }
+
+/*
+ * As uvc_encode_process for a frame in the camera format. The async MPP
+ * encoder keeps a reference on it until the VPU has read it rather than
+ * making the caller wait.
+ */
+bool uvc_encode_process_frame(struct uvc_encode *e, struct uvc_frame *f)
+{
+    bool ret;
+
+    if (f->fcc != e->src.fcc || f->width != e->src.width ||
+        f->height != e->src.height || !uvc_frame_is_packed(f)) {
+        printf("%s: %dx%d fcc 0x%x frame, expect packed %dx%d fcc 0x%x\n",
+               __func__, f->width, f->height, f->fcc,
+               e->src.width, e->src.height, e->src.fcc);
+        return false;
+    }
+    e->frame = f;
+    ret = uvc_encode_process(e, f->virt, f->fd, f->size);
+    e->frame = NULL;
+
+    return ret;
+}
@@ -38,24 +38,133 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include "mpi_enc.h"
+#include "yuv.h"
+
+#define UVC_ENCODE_JOBS (MPI_ENC_ASYNC_DEPTH * 2)
+/* frames with headroom before the MJPEG quant is raised again */
+#define UVC_QUANT_HOLD 30
+/* frames to let a quant change reach the gadget before the next one */
+#define UVC_QUANT_SETTLE (MPI_ENC_ASYNC_DEPTH + 2)
+
+/* MPP failures in a row before UVC_ENCODE_AUTO moves MJPEG to the CPU */
+#define UVC_ENCODE_FALLBACK_FAILS 3
+
+/* MJPEG re-encodes of a frame over the size limit, quant lowered each time */
+#define UVC_ENCODE_RESIZE_MAX 2
+#define UVC_ENCODE_RESIZE_STEP 2
+
+struct uvc_encode;
+struct jpeg_enc;
+struct uvc_meta;
+struct uvc_frame;
+
+enum uvc_encode_backend {
+    UVC_ENCODE_MPP,
+    /* MJPEG only, needs HAVE_JPEG_ENC */
+    UVC_ENCODE_CPU,
+    /* MPP, MJPEG falls back to the CPU when the VPU fails */
+    UVC_ENCODE_AUTO,
+};
+
+/* An encoder implementation behind uvc_encode_init/uvc_encode_process. */
+struct uvc_encode_ops {
+    const char *name;
+    int (*init)(struct uvc_encode *e);
+    void (*exit)(struct uvc_encode *e);
+    /*
+     * Encode the frame, already cropped and scaled, and write it to the
+     * uvc buffer. Returns -1 when the encoder failed, 1 when the frame
+     * was over uvc_encode_frame_limit and not written.
+     */
+    int (*process)(struct uvc_encode *e, unsigned int fcc, void *virt, int fd,
+                   size_t size);
+    /* MJPEG quant 1-10, see uvc_encode_update_quant */
+    int (*set_quant)(struct uvc_encode *e, int quant);
+};
+
+/* A frame in flight in the async encoder. */
+struct uvc_encode_job {
+    struct uvc_encode *e;
+    bool busy;
+    /* the camera frame, held until the VPU has read it */
+    struct uvc_frame *frame;
+    void *extra_data;
+    size_t extra_size;
+    size_t extra_alloc;
+};
 
 struct uvc_encode {
     int width;
     int height;
     int fcc;
     int video_id;
+    /* camera frame, its crop is scaled to width x height */
+    struct yuv_frame src;
+    /* the frame being processed, see uvc_encode_process_frame */
+    struct uvc_frame *frame;
+    bool scale;
+    /* the scaled frame, scale_buf for mpp, plain memory for the cpu encoder */
+    MppBuffer scale_buf;
+    void *scale_virt;
+    /* filter tables and line buffers of the scale pass */
+    struct yuv_scaler *scaler;
+    int zoom;
+    int pan;
+    int tilt;
+    const struct uvc_encode_ops *ops;
+    int fail_count;
     MpiEncTestCmd mpi_cmd;
     MpiEncTestData *mpi_data;
+    /* UVC_ENCODE_CPU */
+    struct jpeg_enc *jpeg;
+    /* written in front of the next frame, see uvc_encode_set_meta */
     void* extra_data;
     size_t extra_size;
-    void *h264_extra_data;
-    size_t h264_extra_size;
+    void *meta_buf;
+    size_t meta_alloc;
+    /* SPS/PPS for H.264, VPS/SPS/PPS for H.265, sent with every frame */
+    void *ps_data;
+    size_t ps_size;
+    /* MJPEG quant following the link, see uvc_encode_update_quant */
+    bool adaptive_quant;
+    int quant;
+    int quant_max;
+    int quant_hold;
+    int quant_settle;
+    size_t last_len;
+    /* frame size limit below dwMaxVideoFrameSize, 0 for none */
+    size_t size_cap;
+    bool async;
+    bool slice;
+    /* IDR applied to the next frame encoded, accessed atomically */
+    bool idr_pending;
+    struct uvc_encode_job jobs[UVC_ENCODE_JOBS];
+    pthread_mutex_t job_lock;
+    sem_t input_sem;
 };
 
-int uvc_encode_init(struct uvc_encode *e, int width, int height,int fcc);
+/* Used by encoders initialized after the call, UVC_ENCODE_MPP by default. */
+int uvc_encode_set_backend(enum uvc_encode_backend backend);
+int uvc_encode_init(struct uvc_encode *e, int width, int height, int fcc, int fps);
+int uvc_encode_prewarm(int width, int height, int fcc);
+int uvc_encode_set_capture(struct uvc_encode *e, int width, int height);
+int uvc_encode_set_roi(struct uvc_encode *e, int zoom, int pan, int tilt);
+int uvc_encode_set_async(struct uvc_encode *e);
+int uvc_encode_set_slice(struct uvc_encode *e, int bytes);
+int uvc_encode_set_rc(struct uvc_encode *e, const MpiEncRcParam *param);
+void uvc_encode_set_adaptive_quant(struct uvc_encode *e, bool enable);
+void uvc_encode_request_idr(struct uvc_encode *e);
+void uvc_encode_set_size_cap(struct uvc_encode *e, size_t bytes);
+int uvc_encode_set_meta(struct uvc_encode *e, const struct uvc_meta *meta,
+                        int count);
+int uvc_encode_set_roi_regions(struct uvc_encode *e, const MpiEncRoiRegion *roi,
+                               int count);
 void uvc_encode_exit(struct uvc_encode *e);
 bool uvc_encode_process(struct uvc_encode *e, void *virt, int fd, size_t size);
+bool uvc_encode_process_frame(struct uvc_encode *e, struct uvc_frame *f);
 
 #ifdef __cplusplus
 }
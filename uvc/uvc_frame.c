@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <time.h>
+#include "uvc_frame.h"
+#include "uvc_video.h"
+
+static int uvc_frame_layout(struct uvc_frame *f)
+{
+    int w = f->width, h = f->height;
+
+    switch (f->fcc) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+        f->planes = 2;
+        f->offset[1] = (size_t)w * h;
+        f->stride[0] = w;
+        f->stride[1] = w;
+        break;
+    case V4L2_PIX_FMT_YUV420:
+        f->planes = 3;
+        f->offset[1] = (size_t)w * h;
+        f->offset[2] = (size_t)w * h * 5 / 4;
+        f->stride[0] = w;
+        f->stride[1] = w / 2;
+        f->stride[2] = w / 2;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+        f->planes = 1;
+        f->stride[0] = w * 2;
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+int uvc_frame_init(struct uvc_frame *f, unsigned int fcc, int width, int height,
+                   void *virt, int fd, size_t size,
+                   uvc_frame_release_callback release, void *priv)
+{
+    struct timespec ts;
+
+    memset(f, 0, sizeof(*f));
+    f->fcc = fcc;
+    f->width = width;
+    f->height = height;
+    f->fd = fd;
+    f->virt = virt;
+    f->size = size;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    f->timestamp = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    f->refcount = 1;
+    f->release = release;
+    f->priv = priv;
+
+    return uvc_frame_layout(f);
+}
+
+bool uvc_frame_is_packed(const struct uvc_frame *f)
+{
+    struct uvc_frame packed;
+    int i;
+
+    memset(&packed, 0, sizeof(packed));
+    packed.fcc = f->fcc;
+    packed.width = f->width;
+    packed.height = f->height;
+    if (uvc_frame_layout(&packed) || packed.planes != f->planes)
+        return false;
+    for (i = 0; i < f->planes; i++)
+        if (packed.offset[i] != f->offset[i] || packed.stride[i] != f->stride[i])
+            return false;
+
+    return true;
+}
+
+struct uvc_frame *uvc_frame_get(struct uvc_frame *f)
+{
+    __atomic_add_fetch(&f->refcount, 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+void uvc_frame_put(struct uvc_frame *f)
+{
+    if (__atomic_sub_fetch(&f->refcount, 1, __ATOMIC_ACQ_REL) == 0 && f->release)
+        f->release(f);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __UVC_FRAME_H__
+#define __UVC_FRAME_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "uvc_meta.h"
+
+#define UVC_FRAME_PLANES 3
+
+struct uvc_frame;
+typedef void (*uvc_frame_release_callback)(struct uvc_frame *frame);
+
+/*
+ * A camera frame shared by the convert and encode stages without copying
+ * it. Every holder takes a reference with uvc_frame_get and drops it with
+ * uvc_frame_put; the last put hands the frame back to its producer with
+ * release, on whichever thread that happens.
+ */
+struct uvc_frame {
+    /* V4L2 fourcc of the pixels */
+    unsigned int fcc;
+    int width;
+    int height;
+    /* dma-buf, -1 when there is none */
+    int fd;
+    void *virt;
+    size_t size;
+    int planes;
+    size_t offset[UVC_FRAME_PLANES];
+    int stride[UVC_FRAME_PLANES];
+    /* capture time, CLOCK_MONOTONIC us */
+    uint64_t timestamp;
+    uint32_t sequence;
+    /* carried with the encoded frame, must stay valid until release */
+    struct uvc_meta meta[UVC_META_MAX];
+    int meta_count;
+    int refcount;
+    uvc_frame_release_callback release;
+    /* the producer's, e.g. its capture buffer */
+    void *priv;
+};
+
+/*
+ * Describe a buffer with packed planes of fcc (NV12, NV21, NV16, I420,
+ * YUYV or UYVY) at width x height, stamped now, with one reference held
+ * by the caller. Returns -1 for another fcc.
+ */
+int uvc_frame_init(struct uvc_frame *f, unsigned int fcc, int width, int height,
+                   void *virt, int fd, size_t size,
+                   uvc_frame_release_callback release, void *priv);
+/* false when the planes are not laid out as uvc_frame_init does */
+bool uvc_frame_is_packed(const struct uvc_frame *f);
+struct uvc_frame *uvc_frame_get(struct uvc_frame *f);
+void uvc_frame_put(struct uvc_frame *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
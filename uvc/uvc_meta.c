@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "uvc_meta.h"
+#include "uvc_video.h"
+
+/* payload of one APP segment, after its 2 length bytes */
+#define UVC_META_APP_LEN 65533
+/* "UVCM" and the type in front of typed APP2 payloads */
+#define UVC_META_TAG_LEN 8
+#define UVC_META_SEI_USER_DATA 5
+
+const uint8_t UVC_META_UUID[16] = {
+    0x48, 0xef, 0x87, 0x2e, 0x7a, 0xf5, 0x45, 0xf4,
+    0x8a, 0x9d, 0x13, 0x81, 0x9a, 0x04, 0x40, 0xc1,
+};
+
+static void uvc_meta_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static size_t uvc_meta_app_tag(const struct uvc_meta *m)
+{
+    return m->type == UVC_META_RAW ? 0 : UVC_META_TAG_LEN;
+}
+
+static size_t uvc_meta_app_size(const struct uvc_meta *m)
+{
+    size_t chunk = UVC_META_APP_LEN - uvc_meta_app_tag(m);
+    size_t n = m->size ? (m->size + chunk - 1) / chunk : 1;
+
+    return n * (4 + uvc_meta_app_tag(m)) + m->size;
+}
+
+static size_t uvc_meta_pack_app(const struct uvc_meta *m, uint8_t *out)
+{
+    const uint8_t *data = (const uint8_t *)m->data;
+    size_t tag = uvc_meta_app_tag(m);
+    size_t chunk = UVC_META_APP_LEN - tag;
+    size_t left = m->size, len = 0, n;
+
+    do {
+        n = left < chunk ? left : chunk;
+        out[len++] = 0xff;
+        out[len++] = 0xe2;
+        out[len++] = (2 + tag + n) >> 8;
+        out[len++] = (2 + tag + n) & 0xff;
+        if (tag) {
+            memcpy(out + len, "UVCM", 4);
+            uvc_meta_be32(out + len + 4, m->type);
+            len += tag;
+        }
+        memcpy(out + len, data, n);
+        len += n;
+        data += n;
+        left -= n;
+    } while (left);
+
+    return len;
+}
+
+/* start code, NAL header, payload type and size, trailing bits */
+static size_t uvc_meta_sei_size(const struct uvc_meta *m)
+{
+    size_t payload = sizeof(UVC_META_UUID) + 4 + m->size;
+    size_t len = 4 + 2 + 1 + payload / 255 + 1 + payload + 1;
+
+    /* an emulation prevention byte at most every two bytes */
+    return len + len / 2;
+}
+
+struct uvc_meta_nal {
+    uint8_t *out;
+    size_t len;
+    int zeros;
+};
+
+static void uvc_meta_put(struct uvc_meta_nal *n, uint8_t b)
+{
+    if (n->zeros >= 2 && b <= 3) {
+        n->out[n->len++] = 3;
+        n->zeros = 0;
+    }
+    n->out[n->len++] = b;
+    n->zeros = b ? 0 : n->zeros + 1;
+}
+
+static size_t uvc_meta_pack_sei(unsigned int fcc, const struct uvc_meta *m,
+                                uint8_t *out)
+{
+    struct uvc_meta_nal n = { out, 0, 0 };
+    const uint8_t *data = (const uint8_t *)m->data;
+    size_t payload = sizeof(UVC_META_UUID) + 4 + m->size;
+    uint8_t type[4];
+    size_t i;
+
+    out[n.len++] = 0;
+    out[n.len++] = 0;
+    out[n.len++] = 0;
+    out[n.len++] = 1;
+    if (fcc == V4L2_PIX_FMT_HEVC) {
+        /* PREFIX_SEI_NUT, nuh_temporal_id_plus1 1 */
+        out[n.len++] = 39 << 1;
+        out[n.len++] = 1;
+    } else {
+        out[n.len++] = 6;
+    }
+
+    uvc_meta_put(&n, UVC_META_SEI_USER_DATA);
+    for (; payload >= 255; payload -= 255)
+        uvc_meta_put(&n, 0xff);
+    uvc_meta_put(&n, payload);
+    for (i = 0; i < sizeof(UVC_META_UUID); i++)
+        uvc_meta_put(&n, UVC_META_UUID[i]);
+    uvc_meta_be32(type, m->type);
+    for (i = 0; i < sizeof(type); i++)
+        uvc_meta_put(&n, type[i]);
+    for (i = 0; i < m->size; i++)
+        uvc_meta_put(&n, data[i]);
+    /* rbsp_trailing_bits */
+    uvc_meta_put(&n, 0x80);
+
+    return n.len;
+}
+
+size_t uvc_meta_pack_size(unsigned int fcc, const struct uvc_meta *meta,
+                          int count)
+{
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!meta[i].data)
+            continue;
+        switch (fcc) {
+        case V4L2_PIX_FMT_MJPEG:
+            size += uvc_meta_app_size(&meta[i]);
+            break;
+        case V4L2_PIX_FMT_H264:
+        case V4L2_PIX_FMT_HEVC:
+            size += uvc_meta_sei_size(&meta[i]);
+            break;
+        }
+    }
+
+    return size;
+}
+
+size_t uvc_meta_pack(unsigned int fcc, const struct uvc_meta *meta, int count,
+                     void *out, size_t size)
+{
+    uint8_t *p = (uint8_t *)out;
+    size_t len = 0;
+    int i;
+
+    if (size < uvc_meta_pack_size(fcc, meta, count))
+        return 0;
+    for (i = 0; i < count; i++) {
+        if (!meta[i].data)
+            continue;
+        switch (fcc) {
+        case V4L2_PIX_FMT_MJPEG:
+            len += uvc_meta_pack_app(&meta[i], p + len);
+            break;
+        case V4L2_PIX_FMT_H264:
+        case V4L2_PIX_FMT_HEVC:
+            len += uvc_meta_pack_sei(fcc, &meta[i], p + len);
+            break;
+        }
+    }
+
+    return len;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __UVC_META_H__
+#define __UVC_META_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-frame side data, carried next to the image payload without
+ * touching it:
+ * MJPEG       APP2 segments after APP0. UVC_META_RAW items fill the
+ *             segments as they are, other items start every segment
+ *             with "UVCM" and their type (4 bytes, big endian).
+ * H.264/H.265 one user data unregistered SEI per item, after the
+ *             parameter sets: UVC_META_UUID, type (4 bytes, big endian),
+ *             data.
+ * YUYV        none in band, see register_uvc_meta_sink.
+ */
+#define UVC_META_MAX 8
+/* the extra_data of uvc_read_camera_buffer */
+#define UVC_META_RAW 0
+
+struct uvc_meta {
+    uint32_t type;
+    const void *data;
+    size_t size;
+};
+
+/* 48ef872e-7af5-45f4-8a9d-13819a0440c1 */
+extern const uint8_t UVC_META_UUID[16];
+
+/* Bytes uvc_meta_pack writes at most for these items. */
+size_t uvc_meta_pack_size(unsigned int fcc, const struct uvc_meta *meta,
+                          int count);
+/*
+ * Lay the items out in the carrier of fcc. Returns the bytes written, 0
+ * for none or when fcc has no carrier.
+ */
+size_t uvc_meta_pack(unsigned int fcc, const struct uvc_meta *meta, int count,
+                     void *out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -39,6 +39,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/prctl.h>
+#include <time.h>
 
 #include <list>
 
@@ -68,7 +69,8 @@ static std::list<struct uvc_video*> lst_v;
 static pthread_mutex_t mtx_v = PTHREAD_MUTEX_INITIALIZER;
 
 
-static struct uvc_buffer* uvc_buffer_create(int width, int height, int id)
+static struct uvc_buffer* uvc_buffer_create(int width, int height, size_t size,
+                                            int id)
 {
     struct uvc_buffer* buffer = NULL;
 
@@ -77,7 +79,7 @@ static struct uvc_buffer* uvc_buffer_create(int width, int height, int id)
         return NULL;
     buffer->width = width;
     buffer->height = height;
-    buffer->size = buffer->width * buffer->height * 2;
+    buffer->size = size;
     buffer->buffer = calloc(1, buffer->size);
     if (!buffer->buffer) {
         free(buffer);
@@ -401,8 +403,14 @@ static int _uvc_buffer_init(struct uvc_video *v)
     int ret = 0;
     struct uvc_buffer* buffer = NULL;
     int width, height;
+    size_t size;
 
     _uvc_get_user_resolution(v, &width, &height);
+    /* compressed frames start smaller, see _uvc_buffer_reserve */
+    if (v->uvc_user.fcc == V4L2_PIX_FMT_YUYV)
+        size = width * height * 2;
+    else
+        size = width * height;
 
     pthread_mutex_lock(&v->buffer_mutex);
 
@@ -415,13 +423,18 @@ static int _uvc_buffer_init(struct uvc_video *v)
     v->uvc->video_id = v->id;
     v->uvc->run = 1;
     v->buffer_s = NULL;
+    v->slice_s = NULL;
+    v->slice_drop = false;
+    v->dqbuf_time = 0;
+    v->dqbuf_interval = 0;
+    v->oversize_count = 0;
     pthread_mutex_init(&v->uvc->write.mutex, NULL);
     pthread_mutex_init(&v->uvc->read.mutex, NULL);
     uvc_buffer_clear(&v->uvc->write);
     uvc_buffer_clear(&v->uvc->read);
     printf("UVC_BUFFER_NUM = %d\n", UVC_BUFFER_NUM);
     for (i = 0; i < UVC_BUFFER_NUM; i++) {
-        buffer = uvc_buffer_create(width, height, v->id);
+        buffer = uvc_buffer_create(width, height, size, v->id);
         if (!buffer) {
             ret = -1;
             goto exit;
@@ -461,11 +474,17 @@ static void _uvc_buffer_deinit(struct uvc_video *v)
         _uvc_video_set_uvc_process(v, false);
         if (v->buffer_s)
             uvc_buffer_push_back(&v->uvc->write, v->buffer_s);
+        if (v->slice_s)
+            uvc_buffer_push_back(&v->uvc->write, v->slice_s);
+        v->buffer_s = NULL;
+        v->slice_s = NULL;
         uvc_buffer_destroy(&v->uvc->write);
         uvc_buffer_destroy(&v->uvc->read);
         delete v->uvc;
         v->uvc = NULL;
     }
+    yuv_scaler_destroy(v->scaler);
+    v->scaler = NULL;
     pthread_mutex_unlock(&v->buffer_mutex);
 }
 
@@ -515,22 +534,55 @@ bool uvc_buffer_write_enable(int id)
     return ret;
 }
 
-#define EX_MAX_LEN 65535
-#define EX_DATA_LEN (EX_MAX_LEN - 2)
+/*
+ * Grow buffer to hold size bytes, up to the frame size the host committed
+ * to. The host would cut a larger frame short, so it is dropped instead.
+ */
+static bool _uvc_buffer_reserve(struct uvc_video *v, struct uvc_buffer *buffer,
+                                size_t size)
+{
+    size_t max = v->uvc_user.max_frame_size;
+    size_t total;
+    void *data;
+
+    if (size <= buffer->total_size)
+        return true;
+    if (!max)
+        max = buffer->width * buffer->height * 2;
+    if (size > max) {
+        v->oversize_count++;
+        printf("%s: %zu byte frame over max frame size %zu, drop (%u)\n",
+               __func__, size, max, v->oversize_count);
+        return false;
+    }
+    /* with headroom, so a slowly growing stream does not realloc per frame */
+    total = size + size / 4;
+    if (total > max)
+        total = max;
+    data = realloc(buffer->buffer, total);
+    if (!data) {
+        printf("%s: realloc %zu fail\n", __func__, total);
+        return false;
+    }
+    buffer->buffer = data;
+    buffer->total_size = total;
+    return true;
+}
+
 static void _uvc_buffer_write(struct uvc_video *v,
                               unsigned short stamp,
                               void* extra_data,
                               size_t extra_size,
                               void* data,
                               size_t size,
+                              const struct yuv_frame* src,
                               unsigned int fcc)
 {
-    const size_t cnt = extra_size / (EX_DATA_LEN + 1) + 1;
     pthread_mutex_lock(&v->buffer_mutex);
     if (v->uvc && data) {
         struct uvc_buffer* buffer = uvc_buffer_pop_front(&v->uvc->write);
         if (buffer && buffer->buffer) {
-            if (buffer->total_size >= extra_size + size) {
+            if (_uvc_buffer_reserve(v, buffer, extra_size + size)) {
                 switch (fcc) {
                 case V4L2_PIX_FMT_YUYV:
 #if YUYV_AS_RAW
@@ -540,54 +592,45 @@ static void _uvc_buffer_write(struct uvc_video *v,
                     memcpy(buffer->buffer, data, size);
 #endif
 #else
-                    NV12_to_YUYV(buffer->width, buffer->height, data, buffer->buffer);
+                    /* Without a descriptor the camera is assumed to deliver NV12. */
+                    if (src && !v->scaler)
+                        v->scaler = yuv_scaler_create();
+                    if (src ? yuv_frame_convert(v->scaler, src, data, fcc,
+                                                buffer->width, buffer->height,
+                                                buffer->buffer)
+                            : yuv_convert(V4L2_PIX_FMT_NV12, fcc,
+                                          buffer->width, buffer->height,
+                                          data, buffer->buffer)) {
+                        printf("%s: no converter for input fcc 0x%x\n",
+                               __func__, src ? src->fcc : 0);
+                        uvc_buffer_push_back(&v->uvc->write, buffer);
+                        goto exit;
+                    }
 #endif
                     break;
                 case V4L2_PIX_FMT_MJPEG:
-                    if (extra_data && buffer->total_size >= extra_size + size + 4 * cnt) {
-                        size_t index = 4;// FF D8 FF E0
-                        size_t len = *((unsigned char*)data + index);
-                        len = len * 256 + *((unsigned char*)data + index + 1);
-                        index = index + len;
+                    if (extra_data && extra_size > 0) {
+                        /* APP segments (uvc_meta_pack) go after SOI and APP0 */
+                        unsigned char* p = (unsigned char*)data;
+                        size_t index = 2;
+
+                        if (size > 6 && p[2] == 0xFF && p[3] == 0xE0)
+                            index += 2 + p[4] * 256 + p[5];
+                        if (index > size)
+                            index = 2;
                         memcpy(buffer->buffer, data, index);
-                        size_t ind = index;
-                        for (size_t i = 1; i < cnt; i++) {
-                            memset((char*)buffer->buffer + ind, 0xFF, 1);
-                            ind++;
-                            memset((char*)buffer->buffer + ind, 0xE2, 1);
-                            ind++;
-                            memset((char*)buffer->buffer + ind, EX_MAX_LEN / 256, 1);
-                            ind++;
-                            memset((char*)buffer->buffer + ind, EX_MAX_LEN % 256, 1);
-                            ind++;
-                            memcpy((char*)buffer->buffer + ind,
-                                   (char*)extra_data + (i - 1) * EX_DATA_LEN, EX_DATA_LEN);
-                            ind += EX_DATA_LEN;
-                        }
-                        memset((char*)buffer->buffer + ind, 0xFF, 1);
-                        ind ++;
-                        memset((char*)buffer->buffer + ind, 0xE2, 1);
-                        ind++;
-                        memset((char*)buffer->buffer + ind,
-                               (2 + extra_size - EX_DATA_LEN * (cnt - 1)) / 256, 1);
-                        ind++;
-                        memset((char*)buffer->buffer + ind,
-                               (2 + extra_size - EX_DATA_LEN * (cnt - 1)) % 256, 1);
-                        ind++;
-                        memcpy((char*)buffer->buffer + ind,
-                               (char*)extra_data + EX_DATA_LEN * (cnt - 1),
-                               extra_size - EX_DATA_LEN * (cnt - 1));
-                        ind += extra_size - EX_DATA_LEN * (cnt - 1);
-                        memcpy((char*)buffer->buffer + ind,
-                                (char*)data + index, size - index);
-                        extra_size += 4 * cnt;
+                        memcpy((char*)buffer->buffer + index, extra_data, extra_size);
+                        memcpy((char*)buffer->buffer + index + extra_size,
+                               (char*)data + index, size - index);
                     } else {
                         memcpy(buffer->buffer, data, size);
+                        extra_size = 0;
                     }
                     //memcpy((char*)buffer->buffer + size, &stamp, sizeof(stamp));
                     //size += sizeof(stamp);
                     break;
                 case V4L2_PIX_FMT_H264:
+                case V4L2_PIX_FMT_HEVC:
                     if (extra_data && extra_size > 0)
                         memcpy(buffer->buffer, extra_data, extra_size);
                     if (extra_size >= 0)
@@ -601,6 +644,7 @@ static void _uvc_buffer_write(struct uvc_video *v,
             }
         }
     }
+exit:
     pthread_mutex_unlock(&v->buffer_mutex);
 }
 
@@ -609,6 +653,7 @@ void uvc_buffer_write(unsigned short stamp,
                       size_t extra_size,
                       void* data,
                       size_t size,
+                      const struct yuv_frame* src,
                       unsigned int fcc,
                       int id)
 {
@@ -617,7 +662,79 @@ void uvc_buffer_write(unsigned short stamp,
         for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
             struct uvc_video* l = *i;
             if (id == l->id) {
-                _uvc_buffer_write(l, stamp, extra_data, extra_size, data, size, fcc);
+                _uvc_buffer_write(l, stamp, extra_data, extra_size, data, size, src, fcc);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+}
+
+static void _uvc_buffer_write_slice(struct uvc_video *v,
+                                    void* extra_data,
+                                    size_t extra_size,
+                                    void* data,
+                                    size_t size,
+                                    bool last)
+{
+    struct uvc_buffer* buffer;
+
+    pthread_mutex_lock(&v->buffer_mutex);
+    if (!v->uvc)
+        goto exit;
+    if (!data || v->slice_drop) {
+        v->slice_drop = !last;
+        if (v->slice_s) {
+            uvc_buffer_push_back(&v->uvc->write, v->slice_s);
+            v->slice_s = NULL;
+        }
+        goto exit;
+    }
+    if (!v->slice_s) {
+        v->slice_s = uvc_buffer_pop_front(&v->uvc->write);
+        if (!v->slice_s || !v->slice_s->buffer ||
+            !_uvc_buffer_reserve(v, v->slice_s, extra_size)) {
+            /* no room, skip the rest of this frame */
+            if (v->slice_s)
+                uvc_buffer_push_back(&v->uvc->write, v->slice_s);
+            v->slice_s = NULL;
+            v->slice_drop = !last;
+            goto exit;
+        }
+        if (extra_data && extra_size > 0)
+            memcpy(v->slice_s->buffer, extra_data, extra_size);
+        v->slice_s->size = extra_size;
+    }
+    buffer = v->slice_s;
+    if (!_uvc_buffer_reserve(v, buffer, buffer->size + size)) {
+        uvc_buffer_push_back(&v->uvc->write, buffer);
+        v->slice_s = NULL;
+        v->slice_drop = !last;
+        goto exit;
+    }
+    memcpy((char*)buffer->buffer + buffer->size, data, size);
+    buffer->size += size;
+    if (last) {
+        uvc_buffer_push_back(&v->uvc->read, buffer);
+        v->slice_s = NULL;
+    }
+exit:
+    pthread_mutex_unlock(&v->buffer_mutex);
+}
+
+void uvc_buffer_write_slice(void* extra_data,
+                            size_t extra_size,
+                            void* data,
+                            size_t size,
+                            bool last,
+                            int id)
+{
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                _uvc_buffer_write_slice(l, extra_data, extra_size, data, size, last);
                 break;
             }
         }
@@ -769,6 +886,141 @@ unsigned int uvc_get_user_fcc(int id)
     return fcc;
 }
 
+static void _uvc_set_user_link_rate(struct uvc_video *v, unsigned int rate)
+{
+    v->uvc_user.link_rate = rate;
+}
+
+void uvc_set_user_link_rate(unsigned int rate, int id)
+{
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                _uvc_set_user_link_rate(l, rate);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+}
+
+static unsigned int _uvc_get_user_link_rate(struct uvc_video *v)
+{
+    return v->uvc_user.link_rate;
+}
+
+unsigned int uvc_get_user_link_rate(int id)
+{
+    unsigned int rate = 0;
+
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                rate = _uvc_get_user_link_rate(l);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+
+    return rate;
+}
+
+static void _uvc_set_user_max_frame_size(struct uvc_video *v, size_t size)
+{
+    v->uvc_user.max_frame_size = size;
+}
+
+void uvc_set_user_max_frame_size(size_t size, int id)
+{
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                _uvc_set_user_max_frame_size(l, size);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+}
+
+static size_t _uvc_get_user_max_frame_size(struct uvc_video *v)
+{
+    return v->uvc_user.max_frame_size;
+}
+
+size_t uvc_get_user_max_frame_size(int id)
+{
+    size_t size = 0;
+
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                size = _uvc_get_user_max_frame_size(l);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+
+    return size;
+}
+
+/*
+ * Called for every buffer the gadget dequeued. A frame is dequeued once
+ * the previous one went over the wire, so when the link cannot keep up
+ * the interval grows beyond the frame interval.
+ */
+static void _uvc_update_dqbuf_interval(struct uvc_video *v)
+{
+    struct timespec ts;
+    unsigned long long now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    if (v->dqbuf_time) {
+        unsigned int interval = now - v->dqbuf_time;
+
+        if (v->dqbuf_interval)
+            v->dqbuf_interval = (v->dqbuf_interval * 3 + interval) / 4;
+        else
+            v->dqbuf_interval = interval;
+    }
+    v->dqbuf_time = now;
+}
+
+static unsigned int _uvc_get_dqbuf_interval(struct uvc_video *v)
+{
+    return v->dqbuf_interval;
+}
+
+unsigned int uvc_get_dqbuf_interval(int id)
+{
+    unsigned int interval = 0;
+
+    pthread_mutex_lock(&mtx_v);
+    if (_uvc_video_id_check(id)) {
+        for (std::list<struct uvc_video*>::iterator i = lst_v.begin(); i != lst_v.end(); ++i) {
+            struct uvc_video* l = *i;
+            if (id == l->id) {
+                interval = _uvc_get_dqbuf_interval(l);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mtx_v);
+
+    return interval;
+}
+
 static void _uvc_memset_uvc_user(struct uvc_video *v)
 {
     memset(&v->uvc_user, 0, sizeof(struct uvc_user));
@@ -804,6 +1056,7 @@ static void _uvc_user_fill_buffer(struct uvc_video *v, struct uvc_device *dev, s
 {
     struct uvc_buffer* buffer = NULL;
 
+    _uvc_update_dqbuf_interval(v);
     while (!(buffer = uvc_buffer_front(&v->uvc->read)) && _uvc_get_user_run_state(v)) {
         pthread_mutex_unlock(&mtx_v);
         usleep(1000);
@@ -42,6 +42,11 @@ extern "C" {
 #include <stddef.h>
 #include <unistd.h>
 #include <linux/videodev2.h>
+#include "yuv.h"
+
+#ifndef V4L2_PIX_FMT_HEVC
+#define V4L2_PIX_FMT_HEVC v4l2_fourcc('H', 'E', 'V', 'C')
+#endif
 
 #define UVC_BUFFER_NUM 3
 #define YUYV_AS_RAW 0
@@ -53,6 +58,10 @@ struct uvc_user {
     unsigned int height;
     bool run;
     unsigned int fcc;
+    /* bytes per second the streaming endpoint can carry, 0 unknown */
+    unsigned int link_rate;
+    /* dwMaxVideoFrameSize committed by the host, 0 unknown */
+    size_t max_frame_size;
 };
 
 struct uvc_video {
@@ -64,6 +73,16 @@ struct uvc_video {
     pthread_mutex_t user_mutex;
     struct uvc_user uvc_user;
     struct uvc_buffer* buffer_s;
+    /* frame being built by uvc_buffer_write_slice */
+    struct uvc_buffer* slice_s;
+    bool slice_drop;
+    /* time between gadget DQBUFs, averaged, in us */
+    unsigned long long dqbuf_time;
+    unsigned int dqbuf_interval;
+    /* frames dropped for not fitting max_frame_size */
+    unsigned int oversize_count;
+    /* crop/scale state of the YUYV path, guarded by buffer_mutex */
+    struct yuv_scaler* scaler;
 };
 
 int uvc_gadget_pthread_create(int *id);
@@ -80,19 +99,45 @@ bool uvc_video_get_uvc_process(int id);
 int uvc_buffer_init(int id);
 void uvc_buffer_deinit(int id);
 bool uvc_buffer_write_enable(int id);
+/*
+ * Queue a frame for the gadget. extra_data is copied in unchanged: after
+ * APP0 for MJPEG (APP segments), in front of the frame for H.264/H.265
+ * (parameter sets, SEI), see uvc_meta_pack.
+ */
 void uvc_buffer_write(unsigned short stamp,
                       void* extra_data,
                       size_t extra_size,
                       void* data,
                       size_t size,
+                      const struct yuv_frame* src,
                       unsigned int fcc,
                       int id);
+/*
+ * Append one H.264/H.265 slice to the frame being built. extra_data goes
+ * in front of the first slice and the frame is handed to the gadget with
+ * the last one. data NULL drops the frame.
+ */
+void uvc_buffer_write_slice(void* extra_data,
+                            size_t extra_size,
+                            void* data,
+                            size_t size,
+                            bool last,
+                            int id);
 void uvc_set_user_resolution(int width, int height, int id);
 void uvc_get_user_resolution(int* width, int* height, int id);
 bool uvc_get_user_run_state(int id);
 void uvc_set_user_run_state(bool state, int id);
 void uvc_set_user_fcc(unsigned int fcc, int id);
 unsigned int uvc_get_user_fcc(int id);
+void uvc_set_user_link_rate(unsigned int rate, int id);
+unsigned int uvc_get_user_link_rate(int id);
+/*
+ * Compressed frames are written into buffers grown on demand up to this
+ * size; larger frames are dropped.
+ */
+void uvc_set_user_max_frame_size(size_t size, int id);
+size_t uvc_get_user_max_frame_size(int id);
+unsigned int uvc_get_dqbuf_interval(int id);
 void uvc_memset_uvc_user(int id);
 pthread_t* uvc_video_get_uvc_pid(int id);
 void uvc_user_fill_buffer(struct uvc_device *dev, struct v4l2_buffer *buf, int id);
@@ -32,25 +32,1160 @@
 
 #include "yuv.h"
 
-void NV12_to_YUYV(int width, int height, void* src, void* dst)
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define YUV_SSE2 1
+#endif
+
+/*
+ * Row kernels take one luma row and the matching chroma samples. For
+ * semi-planar input (NV12/NV21/NV16) u and v point into the same
+ * interleaved row and step is 2, for planar input (I420) step is 1.
+ */
+typedef void (*yuyv_row_func)(const uint8_t* y, const uint8_t* u,
+                              const uint8_t* v, int step,
+                              uint8_t* dst, int width);
+typedef void (*swap_row_func)(const uint8_t* src, uint8_t* dst, int width);
+
+static bool yuv_simd = true;
+
+static void yuyv_row_c(const uint8_t* y, const uint8_t* u,
+                       const uint8_t* v, int step,
+                       uint8_t* dst, int width)
+{
+    int i;
+
+    for (i = 0; i + 1 < width; i += 2) {
+        *dst++ = y[0];
+        *dst++ = *u;
+        *dst++ = y[1];
+        *dst++ = *v;
+        y += 2;
+        u += step;
+        v += step;
+    }
+}
+
+static void swap_row_c(const uint8_t* src, uint8_t* dst, int width)
+{
+    int i;
+
+    for (i = 0; i + 1 < width; i += 2) {
+        dst[0] = src[1];
+        dst[1] = src[0];
+        dst[2] = src[3];
+        dst[3] = src[2];
+        src += 4;
+        dst += 4;
+    }
+}
+
+#if defined(YUV_NEON)
+static void yuyv_row_simd(const uint8_t* y, const uint8_t* u,
+                          const uint8_t* v, int step,
+                          uint8_t* dst, int width)
+{
+    int x = 0;
+    uint8x8x2_t yy;
+    uint8x8x4_t out;
+
+    if (step == 2) {
+        const uint8_t* uv = u < v ? u : v;
+        bool swap = v < u;
+        uint8x8x2_t c;
+
+        for (; x + 16 <= width; x += 16) {
+            yy = vld2_u8(y + x);
+            c = vld2_u8(uv + x);
+            out.val[0] = yy.val[0];
+            out.val[1] = swap ? c.val[1] : c.val[0];
+            out.val[2] = yy.val[1];
+            out.val[3] = swap ? c.val[0] : c.val[1];
+            vst4_u8(dst + x * 2, out);
+        }
+    } else {
+        for (; x + 16 <= width; x += 16) {
+            yy = vld2_u8(y + x);
+            out.val[0] = yy.val[0];
+            out.val[1] = vld1_u8(u + x / 2);
+            out.val[2] = yy.val[1];
+            out.val[3] = vld1_u8(v + x / 2);
+            vst4_u8(dst + x * 2, out);
+        }
+    }
+    yuyv_row_c(y + x, u + x / 2 * step, v + x / 2 * step, step,
+               dst + x * 2, width - x);
+}
+
+static void swap_row_simd(const uint8_t* src, uint8_t* dst, int width)
+{
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16)
+        vst1q_u8(dst + x * 2, vrev16q_u8(vld1q_u8(src + x * 2)));
+    swap_row_c(src + x * 2, dst + x * 2, width - x);
+}
+#elif defined(YUV_SSE2)
+static inline __m128i swap_bytes_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static void yuyv_row_simd(const uint8_t* y, const uint8_t* u,
+                          const uint8_t* v, int step,
+                          uint8_t* dst, int width)
+{
+    int x = 0;
+    __m128i yy, c;
+
+    if (step == 2) {
+        const uint8_t* uv = u < v ? u : v;
+        bool swap = v < u;
+
+        for (; x + 16 <= width; x += 16) {
+            yy = _mm_loadu_si128((const __m128i*)(y + x));
+            c = _mm_loadu_si128((const __m128i*)(uv + x));
+            if (swap)
+                c = swap_bytes_sse2(c);
+            _mm_storeu_si128((__m128i*)(dst + x * 2), _mm_unpacklo_epi8(yy, c));
+            _mm_storeu_si128((__m128i*)(dst + x * 2 + 16), _mm_unpackhi_epi8(yy, c));
+        }
+    } else {
+        for (; x + 16 <= width; x += 16) {
+            yy = _mm_loadu_si128((const __m128i*)(y + x));
+            c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)),
+                                  _mm_loadl_epi64((const __m128i*)(v + x / 2)));
+            _mm_storeu_si128((__m128i*)(dst + x * 2), _mm_unpacklo_epi8(yy, c));
+            _mm_storeu_si128((__m128i*)(dst + x * 2 + 16), _mm_unpackhi_epi8(yy, c));
+        }
+    }
+    yuyv_row_c(y + x, u + x / 2 * step, v + x / 2 * step, step,
+               dst + x * 2, width - x);
+}
+
+static void swap_row_simd(const uint8_t* src, uint8_t* dst, int width)
+{
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8)
+        _mm_storeu_si128((__m128i*)(dst + x * 2),
+                         swap_bytes_sse2(_mm_loadu_si128((const __m128i*)(src + x * 2))));
+    swap_row_c(src + x * 2, dst + x * 2, width - x);
+}
+#else
+#define yuyv_row_simd yuyv_row_c
+#define swap_row_simd swap_row_c
+#endif
+
+static yuyv_row_func yuyv_row(bool simd)
+{
+    return simd ? yuyv_row_simd : yuyv_row_c;
+}
+
+static swap_row_func swap_row(bool simd)
 {
-    int i = 0, j = 0;
-    int* src_y = (int*)src;
-    int* src_uv = (int*)((char*)src + width * height);
-    int* line = (int*)dst;
+    return simd ? swap_row_simd : swap_row_c;
+}
+
+/*
+ * Shared frame loop for all YUV 4:2:x inputs. c_stride is the byte
+ * length of one chroma row and vsub is 1 when chroma is vertically
+ * subsampled (4:2:0), 0 for 4:2:2.
+ */
+static void planar_to_yuyv(int width, int height,
+                           const uint8_t* y, const uint8_t* u,
+                           const uint8_t* v, int step,
+                           int c_stride, int vsub,
+                           uint8_t* dst, bool simd)
+{
+    yuyv_row_func row = yuyv_row(simd);
+    int j;
 
     for (j = 0; j < height; j++) {
-        if (j % 2 != 0)
-            src_uv -= width >> 2;
-        for (i = 0; i<width >> 2; i++) {
-            *line++ = ((*src_y & 0x000000ff)) | ((*src_y & 0x0000ff00) << 8) |
-                      ((*src_uv & 0x000000ff) << 8) | ((*src_uv & 0x0000ff00) << 16);
-            *line++ = ((*src_y & 0x00ff0000) >> 16) | ((*src_y & 0xff000000) >> 8) |
-                      ((*src_uv & 0x00ff0000) >> 8) | ((*src_uv & 0xff000000));
-            src_y++;
-            src_uv++;
+        int c = (j >> vsub) * c_stride;
+        row(y + j * width, u + c, v + c, step, dst + j * width * 2, width);
+    }
+}
+
+static void nv12_to_yuyv(int width, int height, void* src, void* dst, bool simd)
+{
+    const uint8_t* y = (const uint8_t*)src;
+    const uint8_t* uv = y + width * height;
+
+    planar_to_yuyv(width, height, y, uv, uv + 1, 2, width, 1,
+                   (uint8_t*)dst, simd);
+}
+
+static void nv21_to_yuyv(int width, int height, void* src, void* dst, bool simd)
+{
+    const uint8_t* y = (const uint8_t*)src;
+    const uint8_t* vu = y + width * height;
+
+    planar_to_yuyv(width, height, y, vu + 1, vu, 2, width, 1,
+                   (uint8_t*)dst, simd);
+}
+
+static void nv16_to_yuyv(int width, int height, void* src, void* dst, bool simd)
+{
+    const uint8_t* y = (const uint8_t*)src;
+    const uint8_t* uv = y + width * height;
+
+    planar_to_yuyv(width, height, y, uv, uv + 1, 2, width, 0,
+                   (uint8_t*)dst, simd);
+}
+
+static void i420_to_yuyv(int width, int height, void* src, void* dst, bool simd)
+{
+    const uint8_t* y = (const uint8_t*)src;
+    const uint8_t* u = y + width * height;
+    const uint8_t* v = u + width / 2 * height / 2;
+
+    planar_to_yuyv(width, height, y, u, v, 1, width / 2, 1,
+                   (uint8_t*)dst, simd);
+}
+
+static void uyvy_to_yuyv(int width, int height, void* src, void* dst, bool simd)
+{
+    swap_row_func row = swap_row(simd);
+    int j;
+
+    for (j = 0; j < height; j++)
+        row((const uint8_t*)src + j * width * 2,
+            (uint8_t*)dst + j * width * 2, width);
+}
+
+static void yuyv_copy(int width, int height, void* src, void* dst, bool simd)
+{
+    (void)simd;
+    memcpy(dst, src, width * height * 2);
+}
+
+struct yuv_converter {
+    unsigned int src_fcc;
+    unsigned int dst_fcc;
+    void (*convert)(int width, int height, void* src, void* dst, bool simd);
+};
+
+static const struct yuv_converter yuv_converters[] = {
+    { V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV, nv12_to_yuyv },
+    { V4L2_PIX_FMT_NV21, V4L2_PIX_FMT_YUYV, nv21_to_yuyv },
+    { V4L2_PIX_FMT_NV16, V4L2_PIX_FMT_YUYV, nv16_to_yuyv },
+    { V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUYV, i420_to_yuyv },
+    { V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_YUYV, uyvy_to_yuyv },
+    { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_YUYV, yuyv_copy },
+};
+
+static const struct yuv_converter* yuv_find_converter(unsigned int src_fcc,
+                                                      unsigned int dst_fcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(yuv_converters) / sizeof(yuv_converters[0]); i++) {
+        if (yuv_converters[i].src_fcc == src_fcc &&
+            yuv_converters[i].dst_fcc == dst_fcc)
+            return &yuv_converters[i];
+    }
+    return NULL;
+}
+
+void yuv_set_simd(bool enable)
+{
+    yuv_simd = enable;
+}
+
+bool yuv_get_simd(void)
+{
+#if defined(YUV_NEON) || defined(YUV_SSE2)
+    return yuv_simd;
+#else
+    return false;
+#endif
+}
+
+bool yuv_convert_supported(unsigned int src_fcc, unsigned int dst_fcc)
+{
+    return yuv_find_converter(src_fcc, dst_fcc) != NULL;
+}
+
+int yuv_convert(unsigned int src_fcc, unsigned int dst_fcc,
+                int width, int height, void* src, void* dst)
+{
+    const struct yuv_converter* c = yuv_find_converter(src_fcc, dst_fcc);
+
+    if (!c)
+        return -1;
+    c->convert(width, height, src, dst, yuv_get_simd());
+    return 0;
+}
+
+void NV12_to_YUYV(int width, int height, void* src, void* dst)
+{
+    nv12_to_yuyv(width, height, src, dst, yuv_get_simd());
+}
+
+void NV21_to_YUYV(int width, int height, void* src, void* dst)
+{
+    nv21_to_yuyv(width, height, src, dst, yuv_get_simd());
+}
+
+void NV16_to_YUYV(int width, int height, void* src, void* dst)
+{
+    nv16_to_yuyv(width, height, src, dst, yuv_get_simd());
+}
+
+void I420_to_YUYV(int width, int height, void* src, void* dst)
+{
+    i420_to_yuyv(width, height, src, dst, yuv_get_simd());
+}
+
+void UYVY_to_YUYV(int width, int height, void* src, void* dst)
+{
+    uyvy_to_yuyv(width, height, src, dst, yuv_get_simd());
+}
+
+/*
+ * Stripe worker pool. A job is split into at most yuv_threads stripes
+ * of whole rows; the calling thread runs one stripe itself and the
+ * helpers the rest. Jobs are serialized, so two streams scaling at the
+ * same time simply queue behind each other.
+ */
+#define YUV_MAX_THREADS 4
+#define YUV_MIN_STRIPE_ROWS 16
+
+/* stripe is the index of the stripe, below YUV_MAX_THREADS */
+typedef void (*yuv_stripe_func)(void* arg, int stripe, int start, int end);
+
+struct yuv_job {
+    yuv_stripe_func func;
+    void* arg;
+    int rows;
+    int stripes;
+    int next;
+    int done;
+    unsigned int gen;
+};
+
+static struct yuv_job yuv_job;
+static int yuv_threads = 1;
+static pthread_once_t yuv_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t yuv_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t yuv_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t yuv_pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t yuv_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* Called and returns with yuv_pool_mutex held. */
+static void yuv_job_run_stripes(void)
+{
+    while (yuv_job.next < yuv_job.stripes) {
+        int i = yuv_job.next++;
+        int start = yuv_job.rows * i / yuv_job.stripes;
+        int end = yuv_job.rows * (i + 1) / yuv_job.stripes;
+        yuv_stripe_func func = yuv_job.func;
+        void* arg = yuv_job.arg;
+
+        pthread_mutex_unlock(&yuv_pool_mutex);
+        func(arg, i, start, end);
+        pthread_mutex_lock(&yuv_pool_mutex);
+        if (++yuv_job.done == yuv_job.stripes)
+            pthread_cond_signal(&yuv_done_cond);
+    }
+}
+
+static void* yuv_worker(void* arg)
+{
+    unsigned int seen = 0;
+
+    (void)arg;
+    pthread_mutex_lock(&yuv_pool_mutex);
+    while (1) {
+        while (yuv_job.gen == seen)
+            pthread_cond_wait(&yuv_pool_cond, &yuv_pool_mutex);
+        seen = yuv_job.gen;
+        yuv_job_run_stripes();
+    }
+    pthread_mutex_unlock(&yuv_pool_mutex);
+    return NULL;
+}
+
+static void yuv_pool_init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t tid;
+    int i;
+
+    if (cpus > YUV_MAX_THREADS)
+        cpus = YUV_MAX_THREADS;
+    for (i = 1; i < cpus; i++) {
+        if (pthread_create(&tid, NULL, yuv_worker, NULL))
+            break;
+        pthread_detach(tid);
+    }
+    yuv_threads = i;
+}
+
+static void yuv_parallel(yuv_stripe_func func, void* arg, int rows)
+{
+    int stripes;
+
+    pthread_once(&yuv_pool_once, yuv_pool_init);
+    stripes = rows / YUV_MIN_STRIPE_ROWS;
+    if (stripes > yuv_threads)
+        stripes = yuv_threads;
+    if (stripes <= 1) {
+        func(arg, 0, 0, rows);
+        return;
+    }
+
+    pthread_mutex_lock(&yuv_job_lock);
+    pthread_mutex_lock(&yuv_pool_mutex);
+    yuv_job.func = func;
+    yuv_job.arg = arg;
+    yuv_job.rows = rows;
+    yuv_job.stripes = stripes;
+    yuv_job.next = 0;
+    yuv_job.done = 0;
+    yuv_job.gen++;
+    pthread_cond_broadcast(&yuv_pool_cond);
+    yuv_job_run_stripes();
+    while (yuv_job.done < yuv_job.stripes)
+        pthread_cond_wait(&yuv_done_cond, &yuv_pool_mutex);
+    pthread_mutex_unlock(&yuv_pool_mutex);
+    pthread_mutex_unlock(&yuv_job_lock);
+}
+
+/*
+ * Scaling row kernels. All of them work on one plane where a sample is
+ * c bytes wide: c = 1 for luma, c = 2 for the interleaved NV12 chroma.
+ * n is the number of output samples.
+ */
+static void box2_row_c(const uint8_t* s0, const uint8_t* s1,
+                       uint8_t* dst, int n, int c)
+{
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < c; k++) {
+            dst[k] = (s0[k] + s0[c + k] + s1[k] + s1[c + k] + 2) >> 2;
+        }
+        s0 += 2 * c;
+        s1 += 2 * c;
+        dst += c;
+    }
+}
+
+static void box4_row_c(const uint8_t* const* s, uint8_t* dst, int n, int c)
+{
+    int i, j, k, r;
+
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < c; k++) {
+            int sum = 8;
+            for (r = 0; r < 4; r++)
+                for (j = 0; j < 4; j++)
+                    sum += s[r][(i * 4 + j) * c + k];
+            dst[i * c + k] = sum >> 4;
+        }
+    }
+}
+
+static void vblend_row_c(const uint8_t* s0, const uint8_t* s1,
+                         uint8_t* dst, int bytes, int f)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        dst[i] = (s0[i] * (256 - f) + s1[i] * f + 128) >> 8;
+}
+
+#if defined(YUV_NEON)
+static void box2_row_simd(const uint8_t* s0, const uint8_t* s1,
+                          uint8_t* dst, int n, int c)
+{
+    int i = 0;
+
+    if (c == 1) {
+        for (; i + 8 <= n; i += 8) {
+            uint16x8_t sum = vpaddlq_u8(vld1q_u8(s0 + i * 2));
+            sum = vpadalq_u8(sum, vld1q_u8(s1 + i * 2));
+            vst1_u8(dst + i, vrshrn_n_u16(sum, 2));
+        }
+    } else {
+        for (; i + 8 <= n; i += 8) {
+            uint8x8x4_t a = vld4_u8(s0 + i * 4);
+            uint8x8x4_t b = vld4_u8(s1 + i * 4);
+            uint16x8_t u = vaddq_u16(vaddl_u8(a.val[0], a.val[2]),
+                                     vaddl_u8(b.val[0], b.val[2]));
+            uint16x8_t v = vaddq_u16(vaddl_u8(a.val[1], a.val[3]),
+                                     vaddl_u8(b.val[1], b.val[3]));
+            uint8x8x2_t out;
+
+            out.val[0] = vrshrn_n_u16(u, 2);
+            out.val[1] = vrshrn_n_u16(v, 2);
+            vst2_u8(dst + i * 2, out);
         }
     }
+    box2_row_c(s0 + i * 2 * c, s1 + i * 2 * c, dst + i * c, n - i, c);
+}
+
+static void box4_row_simd(const uint8_t* const* s, uint8_t* dst, int n, int c)
+{
+    const uint8_t* t[4];
+    int i = 0, r;
+
+    if (c == 1) {
+        for (; i + 8 <= n; i += 8) {
+            uint16x8_t lo = vpaddlq_u8(vld1q_u8(s[0] + i * 4));
+            uint16x8_t hi = vpaddlq_u8(vld1q_u8(s[0] + i * 4 + 16));
+            for (r = 1; r < 4; r++) {
+                lo = vpadalq_u8(lo, vld1q_u8(s[r] + i * 4));
+                hi = vpadalq_u8(hi, vld1q_u8(s[r] + i * 4 + 16));
+            }
+            vst1_u8(dst + i, vmovn_u16(vcombine_u16(
+                                           vrshrn_n_u32(vpaddlq_u16(lo), 4),
+                                           vrshrn_n_u32(vpaddlq_u16(hi), 4))));
+        }
+    } else {
+        for (; i + 8 <= n; i += 8) {
+            uint16x8_t u[2], v[2];
+            uint8x8x2_t out;
+            int h;
+
+            for (h = 0; h < 2; h++) {
+                uint8x8x4_t a = vld4_u8(s[0] + i * 8 + h * 32);
+                u[h] = vaddl_u8(a.val[0], a.val[2]);
+                v[h] = vaddl_u8(a.val[1], a.val[3]);
+                for (r = 1; r < 4; r++) {
+                    a = vld4_u8(s[r] + i * 8 + h * 32);
+                    u[h] = vaddq_u16(u[h], vaddl_u8(a.val[0], a.val[2]));
+                    v[h] = vaddq_u16(v[h], vaddl_u8(a.val[1], a.val[3]));
+                }
+            }
+            out.val[0] = vmovn_u16(vcombine_u16(vrshrn_n_u32(vpaddlq_u16(u[0]), 4),
+                                                vrshrn_n_u32(vpaddlq_u16(u[1]), 4)));
+            out.val[1] = vmovn_u16(vcombine_u16(vrshrn_n_u32(vpaddlq_u16(v[0]), 4),
+                                                vrshrn_n_u32(vpaddlq_u16(v[1]), 4)));
+            vst2_u8(dst + i * 2, out);
+        }
+    }
+    for (r = 0; r < 4; r++)
+        t[r] = s[r] + i * 4 * c;
+    box4_row_c(t, dst + i * c, n - i, c);
+}
+
+static void vblend_row_simd(const uint8_t* s0, const uint8_t* s1,
+                            uint8_t* dst, int bytes, int f)
+{
+    uint8x8_t f0 = vdup_n_u8(256 - f);
+    uint8x8_t f1 = vdup_n_u8(f);
+    int i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        uint8x16_t a = vld1q_u8(s0 + i);
+        uint8x16_t b = vld1q_u8(s1 + i);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), f0), vget_low_u8(b), f1);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), f0), vget_high_u8(b), f1);
+        vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+    }
+    vblend_row_c(s0 + i, s1 + i, dst + i, bytes - i, f);
+}
+#elif defined(YUV_SSE2)
+/* Sums byte pairs (c = 1) or interleaved UV pairs (c = 2) of one row. */
+static inline __m128i box2_hsum_sse2(__m128i a, int c)
+{
+    if (c == 1)
+        return _mm_add_epi16(_mm_and_si128(a, _mm_set1_epi16(0x00ff)),
+                             _mm_srli_epi16(a, 8));
+    else {
+        __m128i u = _mm_and_si128(a, _mm_set1_epi16(0x00ff));
+        __m128i v = _mm_srli_epi16(a, 8);
+        u = _mm_add_epi32(_mm_and_si128(u, _mm_set1_epi32(0xffff)), _mm_srli_epi32(u, 16));
+        v = _mm_add_epi32(_mm_and_si128(v, _mm_set1_epi32(0xffff)), _mm_srli_epi32(v, 16));
+        return _mm_or_si128(u, _mm_slli_epi32(v, 16));
+    }
+}
+
+static void box2_row_simd(const uint8_t* s0, const uint8_t* s1,
+                          uint8_t* dst, int n, int c)
+{
+    const __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+
+    /* 32 source bytes per row give 16 output bytes */
+    for (; i * c + 16 <= n * c; i += 16 / c) {
+        const uint8_t* a = s0 + i * 2 * c;
+        const uint8_t* b = s1 + i * 2 * c;
+        __m128i lo = _mm_add_epi16(box2_hsum_sse2(_mm_loadu_si128((const __m128i*)a), c),
+                                   box2_hsum_sse2(_mm_loadu_si128((const __m128i*)b), c));
+        __m128i hi = _mm_add_epi16(box2_hsum_sse2(_mm_loadu_si128((const __m128i*)(a + 16)), c),
+                                   box2_hsum_sse2(_mm_loadu_si128((const __m128i*)(b + 16)), c));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i*)(dst + i * c), _mm_packus_epi16(lo, hi));
+    }
+    box2_row_c(s0 + i * 2 * c, s1 + i * 2 * c, dst + i * c, n - i, c);
+}
+
+/* 16 source bytes of four rows reduced to 4 (c = 1) or 2 (c = 2) samples. */
+static inline __m128i box4_sum16_sse2(const uint8_t* const* s, int off, int c)
+{
+    __m128i acc = box2_hsum_sse2(_mm_loadu_si128((const __m128i*)(s[0] + off)), c);
+    int r;
+
+    for (r = 1; r < 4; r++)
+        acc = _mm_add_epi16(acc, box2_hsum_sse2(_mm_loadu_si128((const __m128i*)(s[r] + off)), c));
+    if (c == 1)
+        return _mm_add_epi32(_mm_and_si128(acc, _mm_set1_epi32(0xffff)),
+                             _mm_srli_epi32(acc, 16));
+    /* lanes hold (u, v) sums of two pixels, fold neighbouring lanes */
+    acc = _mm_add_epi16(acc, _mm_srli_epi64(acc, 32));
+    return _mm_shuffle_epi32(acc, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void box4_row_simd(const uint8_t* const* s, uint8_t* dst, int n, int c)
+{
+    const __m128i eight = _mm_set1_epi16(8);
+    const uint8_t* t[4];
+    int i = 0, r;
+
+    if (c == 1) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_packs_epi32(box4_sum16_sse2(s, i * 4, 1),
+                                        box4_sum16_sse2(s, i * 4 + 16, 1));
+            __m128i b = _mm_packs_epi32(box4_sum16_sse2(s, i * 4 + 32, 1),
+                                        box4_sum16_sse2(s, i * 4 + 48, 1));
+            a = _mm_srli_epi16(_mm_add_epi16(a, eight), 4);
+            b = _mm_srli_epi16(_mm_add_epi16(b, eight), 4);
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+        }
+    } else {
+        for (; i + 8 <= n; i += 8) {
+            __m128i a = _mm_unpacklo_epi64(box4_sum16_sse2(s, i * 8, 2),
+                                           box4_sum16_sse2(s, i * 8 + 16, 2));
+            __m128i b = _mm_unpacklo_epi64(box4_sum16_sse2(s, i * 8 + 32, 2),
+                                           box4_sum16_sse2(s, i * 8 + 48, 2));
+            a = _mm_srli_epi16(_mm_add_epi16(a, eight), 4);
+            b = _mm_srli_epi16(_mm_add_epi16(b, eight), 4);
+            _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_packus_epi16(a, b));
+        }
+    }
+    for (r = 0; r < 4; r++)
+        t[r] = s[r] + i * 4 * c;
+    box4_row_c(t, dst + i * c, n - i, c);
+}
+
+static void vblend_row_simd(const uint8_t* s0, const uint8_t* s1,
+                            uint8_t* dst, int bytes, int f)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i f0 = _mm_set1_epi16(256 - f);
+    const __m128i f1 = _mm_set1_epi16(f);
+    const __m128i round = _mm_set1_epi16(128);
+    int i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), f0),
+                                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), f1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), f0),
+                                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), f1));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    vblend_row_c(s0 + i, s1 + i, dst + i, bytes - i, f);
+}
+#else
+#define box2_row_simd box2_row_c
+#define box4_row_simd box4_row_c
+#define vblend_row_simd vblend_row_c
+#endif
+
+/*
+ * Horizontal pass of the bilinear filter. The positions are turned into
+ * tables once per geometry: off is the byte offset of the left source
+ * sample of each output sample, w the weight of its right neighbour
+ * (0..256) per output byte. The right edge is stored as the sample left
+ * of it at full weight, so both neighbours always lie inside the row.
+ */
+struct yuv_hpos {
+    int* off;
+    uint16_t* w;
+    int n;
+    int c;
+};
+
+static void hblend_row_c(const uint8_t* src, uint8_t* dst,
+                         const struct yuv_hpos* h, uint8_t* scratch)
+{
+    int i, k;
+
+    (void)scratch;
+    for (i = 0; i < h->n; i++) {
+        const uint8_t* s = src + h->off[i];
+
+        for (k = 0; k < h->c; k++) {
+            int f = h->w[i * h->c + k];
+            dst[i * h->c + k] = (s[k] * (256 - f) + s[h->c + k] * f + 128) >> 8;
+        }
+    }
+}
+
+/*
+ * p holds the left and right neighbour of every output sample side by
+ * side: byte pairs for c = 1, a UV pair and the next one for c = 2, so
+ * output byte i finds them at p[2 * i - i % c] and c bytes further.
+ */
+static void hblend_pairs_c(const uint8_t* p, const uint16_t* w,
+                           uint8_t* dst, int start, int bytes, int c)
+{
+    int i;
+
+    for (i = start; i < bytes; i++) {
+        const uint8_t* s = p + 2 * i - i % c;
+        dst[i] = (s[0] * (256 - w[i]) + s[c] * w[i] + 128) >> 8;
+    }
+}
+
+#if defined(YUV_NEON)
+static void hblend_pairs_simd(const uint8_t* p, const uint16_t* w,
+                              uint8_t* dst, int bytes, int c)
+{
+    const uint16x8_t one = vdupq_n_u16(256);
+    int i = 0;
+
+    for (; i + 8 <= bytes; i += 8) {
+        uint16x8_t f = vld1q_u16(w + i);
+        uint8x8_t a, b;
+        uint16x8_t sum;
+
+        if (c == 1) {
+            uint8x8x2_t v = vld2_u8(p + i * 2);
+            a = v.val[0];
+            b = v.val[1];
+        } else {
+            uint16x4x2_t v = vld2_u16((const uint16_t*)(p + i * 2));
+            a = vreinterpret_u8_u16(v.val[0]);
+            b = vreinterpret_u8_u16(v.val[1]);
+        }
+        sum = vmulq_u16(vmovl_u8(a), vsubq_u16(one, f));
+        sum = vmlaq_u16(sum, vmovl_u8(b), f);
+        vst1_u8(dst + i, vrshrn_n_u16(sum, 8));
+    }
+    hblend_pairs_c(p, w, dst, i, bytes, c);
+}
+#elif defined(YUV_SSE2)
+static inline __m128i hblend_sse2(__m128i a, __m128i b, __m128i f)
+{
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(_mm_set1_epi16(256), f)),
+                                _mm_mullo_epi16(b, f));
+
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+}
+
+/* the low 16 bits of every 32-bit lane of x and y, in order */
+static inline __m128i pack_lo16_sse2(__m128i x, __m128i y)
+{
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(x, 16), 16),
+                           _mm_srai_epi32(_mm_slli_epi32(y, 16), 16));
+}
+
+static void hblend_pairs_simd(const uint8_t* p, const uint16_t* w,
+                              uint8_t* dst, int bytes, int c)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    int i = 0;
+
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i q0 = _mm_loadu_si128((const __m128i*)(p + i * 2));
+        __m128i q1 = _mm_loadu_si128((const __m128i*)(p + i * 2 + 16));
+        __m128i f0 = _mm_loadu_si128((const __m128i*)(w + i));
+        __m128i f1 = _mm_loadu_si128((const __m128i*)(w + i + 8));
+        __m128i a0, a1, b0, b1;
+
+        if (c == 1) {
+            a0 = _mm_and_si128(q0, mask);
+            b0 = _mm_srli_epi16(q0, 8);
+            a1 = _mm_and_si128(q1, mask);
+            b1 = _mm_srli_epi16(q1, 8);
+        } else {
+            __m128i l = pack_lo16_sse2(q0, q1);
+            __m128i r = _mm_packs_epi32(_mm_srai_epi32(q0, 16), _mm_srai_epi32(q1, 16));
+
+            a0 = _mm_unpacklo_epi8(l, zero);
+            a1 = _mm_unpackhi_epi8(l, zero);
+            b0 = _mm_unpacklo_epi8(r, zero);
+            b1 = _mm_unpackhi_epi8(r, zero);
+        }
+        _mm_storeu_si128((__m128i*)(dst + i),
+                         _mm_packus_epi16(hblend_sse2(a0, b0, f0),
+                                          hblend_sse2(a1, b1, f1)));
+    }
+    hblend_pairs_c(p, w, dst, i, bytes, c);
+}
+#endif
+
+#if defined(YUV_NEON) || defined(YUV_SSE2)
+/*
+ * The neighbours are gathered into scratch (2 * h->n * h->c bytes) with
+ * one load per output sample, the blend itself is then vectorized.
+ */
+static void hblend_row_simd(const uint8_t* src, uint8_t* dst,
+                            const struct yuv_hpos* h, uint8_t* scratch)
+{
+    int i;
+
+    if (h->c == 1) {
+        for (i = 0; i < h->n; i++)
+            memcpy(scratch + i * 2, src + h->off[i], 2);
+    } else {
+        for (i = 0; i < h->n; i++)
+            memcpy(scratch + i * 4, src + h->off[i], 4);
+    }
+    hblend_pairs_simd(scratch, h->w, dst, h->n * h->c, h->c);
+}
+#else
+#define hblend_row_simd hblend_row_c
+#endif
+
+/* Pixel-centre aligned 16.16 source position of output sample i. */
+static int scale_pos(int i, int src_n, int dst_n)
+{
+    int64_t pos = ((int64_t)(2 * i + 1) * src_n << 16) / (2 * dst_n) - 32768;
+
+    if (pos < 0)
+        pos = 0;
+    if (pos > ((int64_t)(src_n - 1) << 16))
+        pos = (int64_t)(src_n - 1) << 16;
+    return (int)pos;
+}
+
+static void hpos_init(struct yuv_hpos* h, int src_n, int dst_n, int c)
+{
+    int i, k;
+
+    h->n = dst_n;
+    h->c = c;
+    for (i = 0; i < dst_n; i++) {
+        int pos = scale_pos(i, src_n, dst_n);
+        int x0 = pos >> 16;
+        int f = (pos >> 8) & 0xff;
+
+        if (x0 >= src_n - 1) {
+            x0 = src_n - 2;
+            f = 256;
+        }
+        h->off[i] = x0 * c;
+        for (k = 0; k < c; k++)
+            h->w[i * c + k] = f;
+    }
+}
+
+enum yuv_scale_mode {
+    YUV_SCALE_BOX2,
+    YUV_SCALE_BOX4,
+    YUV_SCALE_BILINEAR,
+};
+
+#define YUV_ALIGN(x) (((x) + 15) & ~15)
+
+struct yuv_scaler {
+    /* geometry the tables and lines were built for */
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    enum yuv_scale_mode mode;
+    struct yuv_hpos hpos_y;
+    struct yuv_hpos hpos_uv;
+    void* tables;
+    /*
+     * One line per stripe: the vertically blended source row, the
+     * gather scratch of hblend_row_simd and the scaled Y and UV rows
+     * of the YUYV path.
+     */
+    uint8_t* lines;
+    size_t line_size;
+    size_t scratch_off;
+    size_t rows_off;
+};
+
+struct yuv_scale_job {
+    const struct yuv_scaler* s;
+    const struct yuv_nv12* src;
+    const struct yuv_nv12* dst;
+    bool simd;
+    uint8_t* yuyv;
+};
+
+static void yuv_scaler_free(struct yuv_scaler* s)
+{
+    free(s->tables);
+    free(s->lines);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Rebuilds the tables and lines when the geometry changed. */
+static int yuv_scaler_setup(struct yuv_scaler* s, const struct yuv_nv12* src,
+                            int width, int height)
+{
+    int dw = YUV_ALIGN(width);
+
+    /* NV12 output has whole chroma samples, bilinear needs two of them */
+    if (src->width < 4 || src->height < 2 || width < 2 || height < 2 ||
+        (width & 1) || (height & 1))
+        return -1;
+    if (s->lines && s->src_width == src->width && s->src_height == src->height &&
+        s->dst_width == width && s->dst_height == height)
+        return 0;
+
+    yuv_scaler_free(s);
+    if (src->width == width * 2 && src->height == height * 2)
+        s->mode = YUV_SCALE_BOX2;
+    else if (src->width == width * 4 && src->height == height * 4)
+        s->mode = YUV_SCALE_BOX4;
+    else
+        s->mode = YUV_SCALE_BILINEAR;
+
+    if (s->mode == YUV_SCALE_BILINEAR) {
+        s->tables = malloc(sizeof(int) * (width + width / 2) +
+                           sizeof(uint16_t) * width * 2);
+        if (!s->tables)
+            return -1;
+        s->hpos_y.off = (int*)s->tables;
+        s->hpos_uv.off = s->hpos_y.off + width;
+        s->hpos_y.w = (uint16_t*)(s->hpos_uv.off + width / 2);
+        s->hpos_uv.w = s->hpos_y.w + width;
+        hpos_init(&s->hpos_y, src->width, width, 1);
+        hpos_init(&s->hpos_uv, src->width / 2, width / 2, 2);
+    }
+
+    s->scratch_off = YUV_ALIGN(src->width);
+    s->rows_off = s->scratch_off + dw * 2;
+    s->line_size = s->rows_off + dw * 2;
+    s->lines = (uint8_t*)malloc(s->line_size * YUV_MAX_THREADS);
+    if (!s->lines) {
+        yuv_scaler_free(s);
+        return -1;
+    }
+    s->src_width = src->width;
+    s->src_height = src->height;
+    s->dst_width = width;
+    s->dst_height = height;
+    return 0;
+}
+
+static void scale_plane_rows(const struct yuv_scale_job* job,
+                             const uint8_t* src, int src_n, int src_rows,
+                             uint8_t* dst, int dst_n, int dst_rows,
+                             int stride_s, int stride_d, int c,
+                             const struct yuv_hpos* hpos, int start, int end,
+                             uint8_t* line)
+{
+    const struct yuv_scaler* s = job->s;
+    int j, r;
+
+    for (j = start; j < end; j++) {
+        uint8_t* d = dst + j * stride_d;
+
+        switch (s->mode) {
+        case YUV_SCALE_BOX2: {
+            const uint8_t* p = src + j * 2 * stride_s;
+            (job->simd ? box2_row_simd : box2_row_c)(p, p + stride_s, d, dst_n, c);
+        } break;
+        case YUV_SCALE_BOX4: {
+            const uint8_t* p[4];
+            for (r = 0; r < 4; r++)
+                p[r] = src + (j * 4 + r) * stride_s;
+            (job->simd ? box4_row_simd : box4_row_c)(p, d, dst_n, c);
+        } break;
+        case YUV_SCALE_BILINEAR: {
+            int pos = scale_pos(j, src_rows, dst_rows);
+            int y0 = pos >> 16;
+            int f = (pos >> 8) & 0xff;
+            const uint8_t* s0 = src + y0 * stride_s;
+            const uint8_t* row = s0;
+
+            if (f && y0 + 1 < src_rows) {
+                (job->simd ? vblend_row_simd : vblend_row_c)(s0, s0 + stride_s, line,
+                                                             src_n * c, f);
+                row = line;
+            }
+            (job->simd ? hblend_row_simd : hblend_row_c)(row, d, hpos,
+                                                         line + s->scratch_off);
+        } break;
+        }
+    }
+}
+
+/* One stripe covers chroma rows [start, end) and the luma rows above them. */
+static void scale_stripe(void* arg, int stripe, int start, int end)
+{
+    const struct yuv_scale_job* job = (const struct yuv_scale_job*)arg;
+    const struct yuv_nv12* src = job->src;
+    const struct yuv_nv12* dst = job->dst;
+    uint8_t* line = job->s->lines + stripe * job->s->line_size;
+
+    scale_plane_rows(job, src->y, src->width, src->height,
+                     dst->y, dst->width, dst->height,
+                     src->stride, dst->stride, 1, &job->s->hpos_y,
+                     start * 2, end * 2, line);
+    scale_plane_rows(job, src->uv, src->width / 2, src->height / 2,
+                     dst->uv, dst->width / 2, dst->height / 2,
+                     src->stride, dst->stride, 2, &job->s->hpos_uv,
+                     start, end, line);
+}
+
+/*
+ * Fused crop/scale/convert: each output row is scaled into a line
+ * buffer and packed straight to YUYV, so no scaled NV12 frame is
+ * ever written.
+ */
+static void scale_yuyv_stripe(void* arg, int stripe, int start, int end)
+{
+    const struct yuv_scale_job* job = (const struct yuv_scale_job*)arg;
+    const struct yuv_nv12* src = job->src;
+    const struct yuv_nv12* dst = job->dst;
+    uint8_t* line = job->s->lines + stripe * job->s->line_size;
+    uint8_t* y_row = line + job->s->rows_off;
+    uint8_t* uv_row = y_row + YUV_ALIGN(dst->width);
+    yuyv_row_func row = yuyv_row(job->simd);
+    int j, k;
+
+    for (j = start; j < end; j++) {
+        scale_plane_rows(job, src->uv, src->width / 2, src->height / 2,
+                         uv_row, dst->width / 2, dst->height / 2,
+                         src->stride, 0, 2, &job->s->hpos_uv, j, j + 1, line);
+        for (k = j * 2; k < j * 2 + 2; k++) {
+            scale_plane_rows(job, src->y, src->width, src->height,
+                             y_row, dst->width, dst->height,
+                             src->stride, 0, 1, &job->s->hpos_y, k, k + 1, line);
+            row(y_row, uv_row, uv_row + 1, 2, job->yuyv + k * dst->width * 2,
+                dst->width);
+        }
+    }
+}
+
+void yuv_nv12_init(struct yuv_nv12* img, void* buf, int width, int height)
+{
+    img->y = (uint8_t*)buf;
+    img->uv = img->y + width * height;
+    img->width = width;
+    img->height = height;
+    img->stride = width;
+}
+
+struct yuv_scaler* yuv_scaler_create(void)
+{
+    return (struct yuv_scaler*)calloc(1, sizeof(struct yuv_scaler));
+}
+
+void yuv_scaler_destroy(struct yuv_scaler* s)
+{
+    if (!s)
+        return;
+    yuv_scaler_free(s);
+    free(s);
+}
+
+int yuv_scaler_nv12(struct yuv_scaler* s, const struct yuv_nv12* src,
+                    const struct yuv_nv12* dst)
+{
+    struct yuv_scale_job job;
+
+    if (yuv_scaler_setup(s, src, dst->width, dst->height))
+        return -1;
+    job.s = s;
+    job.src = src;
+    job.dst = dst;
+    job.simd = yuv_get_simd();
+    job.yuyv = NULL;
+    yuv_parallel(scale_stripe, &job, dst->height / 2);
+    return 0;
+}
+
+int yuv_scaler_yuyv(struct yuv_scaler* s, const struct yuv_nv12* src,
+                    void* dst, int width, int height)
+{
+    struct yuv_scale_job job;
+    struct yuv_nv12 geom;
+
+    if (yuv_scaler_setup(s, src, width, height))
+        return -1;
+    memset(&geom, 0, sizeof(geom));
+    geom.width = width;
+    geom.height = height;
+    job.s = s;
+    job.src = src;
+    job.dst = &geom;
+    job.simd = yuv_get_simd();
+    job.yuyv = (uint8_t*)dst;
+    yuv_parallel(scale_yuyv_stripe, &job, height / 2);
+    return 0;
+}
+
+int NV12_scale(const struct yuv_nv12* src, const struct yuv_nv12* dst)
+{
+    struct yuv_scaler s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+    ret = yuv_scaler_nv12(&s, src, dst);
+    yuv_scaler_free(&s);
+    return ret;
+}
+
+int NV12_scale_to_YUYV(const struct yuv_nv12* src, void* dst, int width, int height)
+{
+    struct yuv_scaler s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+    ret = yuv_scaler_yuyv(&s, src, dst, width, height);
+    yuv_scaler_free(&s);
+    return ret;
+}
+
+void yuv_nv12_crop(struct yuv_nv12* img, const struct yuv_frame* frame, void* buf)
+{
+    int x = 0, y = 0;
+
+    yuv_nv12_init(img, buf, frame->width, frame->height);
+    if (frame->crop_w > 0 && frame->crop_h > 0) {
+        x = frame->crop_x & ~1;
+        y = frame->crop_y & ~1;
+        img->width = frame->crop_w;
+        img->height = frame->crop_h;
+    }
+    img->y += y * img->stride + x;
+    img->uv += y / 2 * img->stride + x;
+}
+
+int yuv_frame_convert(struct yuv_scaler* scaler, const struct yuv_frame* frame,
+                      void* buf, unsigned int dst_fcc, int width, int height,
+                      void* dst)
+{
+    struct yuv_nv12 img;
+
+    if (!frame->crop_w && frame->width == width && frame->height == height)
+        return yuv_convert(frame->fcc, dst_fcc, width, height, buf, dst);
+    if (frame->fcc != V4L2_PIX_FMT_NV12 || dst_fcc != V4L2_PIX_FMT_YUYV)
+        return -1;
+    yuv_nv12_crop(&img, frame, buf);
+    if (scaler)
+        return yuv_scaler_yuyv(scaler, &img, dst, width, height);
+    return NV12_scale_to_YUYV(&img, dst, width, height);
 }
 
 void raw16_to_raw8(int width, int height, void* src, void* dst)
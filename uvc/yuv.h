@@ -36,7 +36,83 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Describes the camera frame handed to the YUYV output path. A non-zero
+ * crop_w/crop_h selects the region that is scaled to the output size.
+ */
+struct yuv_frame {
+    unsigned int fcc;
+    int width;
+    int height;
+    int crop_x;
+    int crop_y;
+    int crop_w;
+    int crop_h;
+};
+
+/*
+ * Converters are looked up by (src, dst) V4L2 fourcc. The vectorized
+ * kernels (NEON on ARM, SSE2 on x86) are used unless disabled with
+ * yuv_set_simd(false), which selects the scalar reference kernels.
+ */
+void yuv_set_simd(bool enable);
+bool yuv_get_simd(void);
+bool yuv_convert_supported(unsigned int src_fcc, unsigned int dst_fcc);
+int yuv_convert(unsigned int src_fcc, unsigned int dst_fcc,
+                int width, int height, void* src, void* dst);
+
+/*
+ * NV12 image with separate plane pointers and a common stride, so a
+ * crop of a larger buffer can be described without copying it.
+ */
+struct yuv_nv12 {
+    uint8_t* y;
+    uint8_t* uv;
+    int width;
+    int height;
+    int stride;
+};
+
+void yuv_nv12_init(struct yuv_nv12* img, void* buf, int width, int height);
+/*
+ * Exact 2:1 and 4:1 reductions use a box filter, any other ratio is
+ * bilinear. Rows are split into stripes across a small worker pool.
+ * The output size must be even. A yuv_scaler keeps the filter tables
+ * and line buffers between frames and only rebuilds them when the
+ * geometry changes; use one per stream, it is not thread safe.
+ */
+struct yuv_scaler;
+struct yuv_scaler* yuv_scaler_create(void);
+void yuv_scaler_destroy(struct yuv_scaler* s);
+int yuv_scaler_nv12(struct yuv_scaler* s, const struct yuv_nv12* src,
+                    const struct yuv_nv12* dst);
+/* Same filter, written directly as packed YUYV. */
+int yuv_scaler_yuyv(struct yuv_scaler* s, const struct yuv_nv12* src,
+                    void* dst, int width, int height);
+/* One-off versions of the above, they set up a scaler per call. */
+int NV12_scale(const struct yuv_nv12* src, const struct yuv_nv12* dst);
+int NV12_scale_to_YUYV(const struct yuv_nv12* src, void* dst, int width, int height);
+
+/* View of the crop (or the whole frame) of an NV12 yuv_frame at buf. */
+void yuv_nv12_crop(struct yuv_nv12* img, const struct yuv_frame* frame, void* buf);
+/*
+ * Convert buf described by frame to dst_fcc at width x height. A crop
+ * or size change is done in the same pass (NV12 to YUYV only), with
+ * scaler when given so its state is kept between frames.
+ */
+int yuv_frame_convert(struct yuv_scaler* scaler, const struct yuv_frame* frame,
+                      void* buf, unsigned int dst_fcc, int width, int height,
+                      void* dst);
+
 void NV12_to_YUYV(int width, int height, void* src, void* dst);
+void NV21_to_YUYV(int width, int height, void* src, void* dst);
+void NV16_to_YUYV(int width, int height, void* src, void* dst);
+void I420_to_YUYV(int width, int height, void* src, void* dst);
+void UYVY_to_YUYV(int width, int height, void* src, void* dst);
 void raw16_to_raw8(int width, int height, void* src, void* dst);
 #ifdef __cplusplus
 }
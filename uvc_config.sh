@@ -9,6 +9,7 @@ UVC_CONTROL_DIR=${UVC_DIR}/control/
 UVC_U_DIR=${UVC_STREAMING_DIR}/uncompressed/u/
 UVC_M_DIR=${UVC_STREAMING_DIR}/mjpeg/m/
 UVC_F_DIR=${UVC_STREAMING_DIR}/framebased/f/
+UVC_F2_DIR=${UVC_STREAMING_DIR}/framebased/f2/
 
 configure_uvc_resolution_yuyv()
 {
@@ -55,6 +56,20 @@ configure_uvc_resolution_h264()
 	echo -e "333333\n666666\n1000000\n2000000" > ${DIR}/dwFrameInterval
 }
 
+configure_uvc_resolution_h265()
+{
+	W=$1
+	H=$2
+	DIR=${UVC_F2_DIR}/${H}p/
+	mkdir ${DIR}
+	echo $W > ${DIR}/wWidth
+	echo $H > ${DIR}/wHeight
+	echo 333333 > ${DIR}/dwDefaultFrameInterval
+	echo $((W*H*5)) > ${DIR}/dwMinBitRate
+	echo $((W*H*5)) > ${DIR}/dwMaxBitRate
+	echo -e "333333\n666666\n1000000\n2000000" > ${DIR}/dwFrameInterval
+}
+
 /etc/init.d/S10udev stop
 
 umount /sys/kernel/config
@@ -79,6 +94,13 @@ mkdir ${UVC_CONTROL_DIR}/header/h
 ln -s ${UVC_CONTROL_DIR}/header/h ${UVC_CONTROL_DIR}/class/fs/h
 ln -s ${UVC_CONTROL_DIR}/header/h ${UVC_CONTROL_DIR}/class/ss/h
 
+## camera terminal: AE mode (D1), zoom absolute (D9), pan/tilt absolute (D11)
+## only kernels with a writable bmControls can advertise them
+UVC_CAMERA_DIR=${UVC_CONTROL_DIR}/terminal/camera/default/
+if [ -w ${UVC_CAMERA_DIR}/bmControls ]; then
+	echo -e "0x02\n0x0a\n0x00" > ${UVC_CAMERA_DIR}/bmControls
+fi
+
 ##YUYV support config
 mkdir ${UVC_U_DIR}
 configure_uvc_resolution_yuyv 640 480
@@ -98,10 +120,19 @@ configure_uvc_resolution_h264 640 480
 configure_uvc_resolution_h264 1280 720
 configure_uvc_resolution_h264 1920 1080
 
+## h.265 support config, framebased defaults to the H264 guid
+mkdir ${UVC_F2_DIR}
+echo -ne "H265\x00\x00\x10\x00\x80\x00\x00\xaa\x00\x38\x9b\x71" > ${UVC_F2_DIR}/guidFormat
+configure_uvc_resolution_h265 640 480
+configure_uvc_resolution_h265 1280 720
+configure_uvc_resolution_h265 1920 1080
+configure_uvc_resolution_h265 2560 1440
+
 mkdir ${UVC_STREAMING_DIR}/header/h
 ln -s ${UVC_U_DIR} ${UVC_STREAMING_DIR}/header/h/u
 ln -s ${UVC_M_DIR} ${UVC_STREAMING_DIR}/header/h/m
 ln -s ${UVC_F_DIR} ${UVC_STREAMING_DIR}/header/h/f
+ln -s ${UVC_F2_DIR} ${UVC_STREAMING_DIR}/header/h/f2
 ln -s ${UVC_STREAMING_DIR}/header/h ${UVC_STREAMING_DIR}/class/fs/h
 ln -s ${UVC_STREAMING_DIR}/header/h ${UVC_STREAMING_DIR}/class/hs/h
 ln -s ${UVC_STREAMING_DIR}/header/h ${UVC_STREAMING_DIR}/class/ss/h
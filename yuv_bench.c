@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <getopt.h>
+#include <linux/videodev2.h>
+#include "yuv.h"
+#ifdef HAVE_JPEG_ENC
+#include "jpeg_enc.h"
+#endif
+
+/*
+ * Times the yuv.c kernels without a USB host or camera. Every case is
+ * first run with the scalar kernels and the vectorized output is
+ * compared against it, then timed warm (same buffers back to back) and
+ * cold (caches evicted before each frame). With libjpeg the CPU MJPEG
+ * encoder (jpeg_enc.c) is timed as well.
+ */
+
+#define FLUSH_SIZE (32 << 20)
+
+struct bench_res {
+    int width;
+    int height;
+};
+
+static const struct bench_res bench_res[] = {
+    {  640,  480 },
+    { 1280,  720 },
+    { 1920, 1080 },
+    { 2560, 1440 },
+    { 2592, 1944 },
+};
+
+struct bench_ctx {
+    int width;
+    int height;
+    uint8_t *src;
+    uint8_t *dst;
+    int dst_width;
+    int dst_height;
+};
+
+struct bench_case {
+    const char *name;
+    unsigned int src_fcc;
+    /* output size as num/den of the input, 0 for same size */
+    int num;
+    int den;
+    int (*run)(const struct bench_case *c, struct bench_ctx *ctx);
+    size_t (*dst_size)(int width, int height);
+};
+
+static uint8_t *flush_buf;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void flush_cache(void)
+{
+    int i;
+
+    for (i = 0; i < FLUSH_SIZE; i += 64)
+        flush_buf[i]++;
+}
+
+static size_t src_size(unsigned int fcc, int width, int height)
+{
+    switch (fcc) {
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_UYVY:
+        return width * height * 2;
+    default:
+        return width * height * 3 / 2;
+    }
+}
+
+static size_t yuyv_size(int width, int height)
+{
+    return width * height * 2;
+}
+
+static size_t nv12_size(int width, int height)
+{
+    return width * height * 3 / 2;
+}
+
+static int run_convert(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    return yuv_convert(c->src_fcc, V4L2_PIX_FMT_YUYV, ctx->width, ctx->height,
+                       ctx->src, ctx->dst);
+}
+
+/* one scaler for all cases, as a stream keeps one across frames */
+static struct yuv_scaler *scaler;
+
+static int run_scale(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    struct yuv_nv12 src, dst;
+
+    (void)c;
+    yuv_nv12_init(&src, ctx->src, ctx->width, ctx->height);
+    yuv_nv12_init(&dst, ctx->dst, ctx->dst_width, ctx->dst_height);
+    return yuv_scaler_nv12(scaler, &src, &dst);
+}
+
+static int run_scale_yuyv(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    struct yuv_nv12 src;
+
+    (void)c;
+    yuv_nv12_init(&src, ctx->src, ctx->width, ctx->height);
+    return yuv_scaler_yuyv(scaler, &src, ctx->dst, ctx->dst_width, ctx->dst_height);
+}
+
+/* scale to NV12, then convert: what the fused path saves */
+static int run_scale_then_yuyv(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    static uint8_t *tmp;
+    static size_t tmp_size;
+    size_t size = nv12_size(ctx->dst_width, ctx->dst_height);
+    struct yuv_nv12 src, dst;
+
+    (void)c;
+    if (size > tmp_size) {
+        free(tmp);
+        tmp = (uint8_t *)malloc(size);
+        tmp_size = tmp ? size : 0;
+        if (!tmp)
+            return -1;
+    }
+    yuv_nv12_init(&src, ctx->src, ctx->width, ctx->height);
+    yuv_nv12_init(&dst, tmp, ctx->dst_width, ctx->dst_height);
+    if (yuv_scaler_nv12(scaler, &src, &dst))
+        return -1;
+    return yuv_convert(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUYV,
+                       ctx->dst_width, ctx->dst_height, tmp, ctx->dst);
+}
+
+#ifdef HAVE_JPEG_ENC
+struct bench_jpeg {
+    struct jpeg_enc *j;
+    int width;
+    int height;
+};
+
+/* the cpu MJPEG backend at the default quant, output zero padded */
+static int run_jpeg_threads(const struct bench_case *c, struct bench_ctx *ctx,
+                            struct bench_jpeg *b, int threads)
+{
+    void *data;
+    size_t len, size = ctx->width * ctx->height * 2;
+
+    if (!b->j || b->width != ctx->width || b->height != ctx->height) {
+        jpeg_enc_destroy(b->j);
+        b->j = jpeg_enc_create(ctx->width, ctx->height, c->src_fcc, threads);
+        if (!b->j)
+            return -1;
+        jpeg_enc_set_quality(b->j, 68);
+        b->width = ctx->width;
+        b->height = ctx->height;
+    }
+    if (jpeg_enc_encode(b->j, ctx->src, &data, &len) || len > size)
+        return -1;
+    memcpy(ctx->dst, data, len);
+    memset(ctx->dst + len, 0, size - len);
+    return 0;
+}
+
+static int run_jpeg(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    static struct bench_jpeg b;
+
+    return run_jpeg_threads(c, ctx, &b, 1);
+}
+
+static int run_jpeg_mt(const struct bench_case *c, struct bench_ctx *ctx)
+{
+    static struct bench_jpeg b;
+
+    return run_jpeg_threads(c, ctx, &b, 0);
+}
+#endif
+
+static const struct bench_case bench_cases[] = {
+    { "NV12->YUYV",        V4L2_PIX_FMT_NV12,   0, 0, run_convert,    yuyv_size },
+    { "NV21->YUYV",        V4L2_PIX_FMT_NV21,   0, 0, run_convert,    yuyv_size },
+    { "NV16->YUYV",        V4L2_PIX_FMT_NV16,   0, 0, run_convert,    yuyv_size },
+    { "I420->YUYV",        V4L2_PIX_FMT_YUV420, 0, 0, run_convert,    yuyv_size },
+    { "UYVY->YUYV",        V4L2_PIX_FMT_UYVY,   0, 0, run_convert,    yuyv_size },
+    { "NV12 box 1/2",      V4L2_PIX_FMT_NV12,   1, 2, run_scale,      nv12_size },
+    { "NV12 box 1/4",      V4L2_PIX_FMT_NV12,   1, 4, run_scale,      nv12_size },
+    { "NV12 bilinear 3/4", V4L2_PIX_FMT_NV12,   3, 4, run_scale,      nv12_size },
+    { "NV12 bilinear 2/3", V4L2_PIX_FMT_NV12,   2, 3, run_scale,      nv12_size },
+    { "NV12 bilinear 4/3", V4L2_PIX_FMT_NV12,   4, 3, run_scale,      nv12_size },
+    { "NV12 3/4 ->YUYV",   V4L2_PIX_FMT_NV12,   3, 4, run_scale_yuyv, yuyv_size },
+    { "NV12 3/4 2-pass",   V4L2_PIX_FMT_NV12,   3, 4, run_scale_then_yuyv, yuyv_size },
+#ifdef HAVE_JPEG_ENC
+    { "NV12->JPEG cpu",    V4L2_PIX_FMT_NV12,   0, 0, run_jpeg,       yuyv_size },
+    { "NV12->JPEG cpu mt", V4L2_PIX_FMT_NV12,   0, 0, run_jpeg_mt,    yuyv_size },
+#endif
+};
+
+static double bench_time(const struct bench_case *c, struct bench_ctx *ctx,
+                         int loops, bool cold)
+{
+    double total = 0, t;
+    int i;
+
+    for (i = 0; i < loops; i++) {
+        if (cold)
+            flush_cache();
+        t = now_ms();
+        c->run(c, ctx);
+        total += now_ms() - t;
+    }
+    return total / loops;
+}
+
+static int bench_one(const struct bench_case *c, const struct bench_res *r,
+                     int loops)
+{
+    struct bench_ctx ctx;
+    size_t ssize, dsize;
+    uint8_t *ref;
+    double warm, cold, bytes;
+    bool match;
+    size_t i;
+
+    ctx.width = r->width;
+    ctx.height = r->height;
+    ctx.dst_width = c->den ? (r->width * c->num / c->den) & ~1 : r->width;
+    ctx.dst_height = c->den ? (r->height * c->num / c->den) & ~1 : r->height;
+    ssize = src_size(c->src_fcc, r->width, r->height);
+    dsize = c->dst_size(ctx.dst_width, ctx.dst_height);
+    ctx.src = (uint8_t *)malloc(ssize);
+    ctx.dst = (uint8_t *)malloc(dsize);
+    ref = (uint8_t *)malloc(dsize);
+    if (!ctx.src || !ctx.dst || !ref) {
+        printf("%s: malloc fail\n", __func__);
+        free(ctx.src);
+        free(ctx.dst);
+        free(ref);
+        return -1;
+    }
+    srand(r->width * r->height);
+    for (i = 0; i < ssize; i++)
+        ctx.src[i] = rand();
+
+    yuv_set_simd(false);
+    memset(ref, 0, dsize);
+    c->run(c, &ctx);
+    memcpy(ref, ctx.dst, dsize);
+    yuv_set_simd(true);
+    memset(ctx.dst, 0, dsize);
+    c->run(c, &ctx);
+    match = !memcmp(ref, ctx.dst, dsize);
+
+    c->run(c, &ctx);
+    warm = bench_time(c, &ctx, loops, false);
+    cold = bench_time(c, &ctx, loops, true);
+    bytes = ssize + dsize;
+    printf("%-18s %4dx%-4d %8.3f %7.2f %6.3f %8.3f %7.2f %6.3f  %s\n",
+           c->name, r->width, r->height,
+           warm, bytes / (warm * 1e6), warm * 1e6 / (r->width * r->height),
+           cold, bytes / (cold * 1e6), cold * 1e6 / (r->width * r->height),
+           match ? "ok" : "MISMATCH");
+
+    free(ctx.src);
+    free(ctx.dst);
+    free(ref);
+    return match ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s options\n"
+           "-n --loops <n>   Frames timed per case, default 20.\n"
+           "-c --case <name> Only run cases whose name contains <name>.\n"
+           , name);
+    printf("e.g. %s -n 50 -c YUYV\n", name);
+    exit(0);
+}
+
+int main(int argc, char* argv[])
+{
+    int loops = 20;
+    const char *filter = NULL;
+    int fail = 0;
+    unsigned int i, j;
+    int next_option;
+    const char* const short_options = "n:c:h";
+    const struct option long_options[] = {
+        {"loops", 1, NULL, 'n'},
+        {"case", 1, NULL, 'c'},
+        {"help", 0, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    do {
+        next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+        switch (next_option) {
+        case 'n':
+            loops = atoi(optarg);
+            if (loops <= 0)
+                usage(argv[0]);
+            break;
+        case 'c':
+            filter = optarg;
+            break;
+        case -1:
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    } while (next_option != -1);
+
+    flush_buf = (uint8_t *)calloc(FLUSH_SIZE, 1);
+    scaler = yuv_scaler_create();
+    if (!flush_buf || !scaler)
+        return -1;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    printf("simd: neon\n");
+#elif defined(__SSE2__)
+    printf("simd: sse2\n");
+#else
+    printf("simd: none (scalar only)\n");
+#endif
+    printf("%-18s %9s %8s %7s %6s %8s %7s %6s\n", "kernel", "size",
+           "warm ms", "GB/s", "ns/px", "cold ms", "GB/s", "ns/px");
+    for (i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        if (filter && !strstr(bench_cases[i].name, filter))
+            continue;
+        for (j = 0; j < sizeof(bench_res) / sizeof(bench_res[0]); j++)
+            if (bench_one(&bench_cases[i], &bench_res[j], loops))
+                fail++;
+    }
+
+    yuv_scaler_destroy(scaler);
+    free(flush_buf);
+    if (fail)
+        printf("%d case(s) differ from the scalar reference\n", fail);
+    return fail ? 1 : 0;
+}